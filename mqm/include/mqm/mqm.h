@@ -1,10 +1,36 @@
 #pragma once
 #include <vector>
+#include <algorithm>
 #include <map>
 #include <mutex>
 #include <memory>
 #include <future>
 #include <iostream>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <iterator>
+#include <functional>
+#include <type_traits>
+#include <cmath>
+#include <limits>
+
+#include "mqm/mqm_queue.h"
+#include "mqm/mqm_pool.h"
+#include "mqm/mqm_fair.h"
+#include "mqm/mqm_deadline.h"
+#include "mqm/mqm_control.h"
+#include "mqm/mqm_limit.h"
+#include "mqm/mqm_spill.h"
+#include "mqm/mqm_dedup.h"
+#include "mqm/mqm_latest.h"
+#include "mqm/mqm_snapshot.h"
+#include "mqm/mqm_watchdog.h"
+#include "mqm/mqm_timer.h"
+#include "mqm/mqm_window.h"
+#include "mqm/mqm_join.h"
+#include "mqm/mqm_merge.h"
 
 namespace mqm
 {
@@ -14,213 +40,3178 @@ struct MqmConsumer
 {
     virtual ~MqmConsumer() = default;
     virtual void consume(const Key& id, const Value& value) = 0;
+
+    // false: values of one batch may be consumed concurrently and in any order
+    // (counters, set inserts ...), consume() must be thread-safe then
+    virtual bool ordered() const { return true; }
+
+    // true: consume() may block (I/O ...), its key is drained on the
+    // processor's blocking pool so it can't pin down the CPU-bound workers
+    virtual bool blocking() const { return false; }
+
+    // true: the sink hands whole batches to consumeBatch(), one virtual call
+    // per batch instead of per value; a throw fails the whole batch
+    virtual bool batched() const { return false; }
+    virtual void consumeBatch(const Key& id, const Value* begin, const Value* end)
+    {
+        for (auto v = begin; v != end; ++v)
+            consume(id, *v);
+    }
+
+    // non-zero: the key's drain is poked that often even without data,
+    // a batched consumer then gets an empty range
+    virtual std::chrono::milliseconds tick() const { return {}; }
 };
 
 template<typename Key, typename Value>
 using MqmConsumerPtr = std::shared_ptr<MqmConsumer<Key, Value>>;
 
-// data + signal + stopped flag
-template<typename Value>
-class MqmSource
+// wakes the drain task of a key group when any of its sources gets data:
+// a dedicated thread blocked in wait(), or a pool task posted by raise()
+// (a pooled task is never posted twice nor run concurrently with itself,
+//  so the group keeps its single execution context)
+class MqmSignal : public std::enable_shared_from_this<MqmSignal>
 {
-    std::vector<Value> values_;
+    enum class State { Idle, Scheduled, Running, Rerun };
+
     std::mutex mtx_;
     std::condition_variable cv_;
-    bool stopped_ = false;
+    bool raised_ = false;
 
-public:
-    void enqueue(Value&& v)
+    MqmThreadPoolPtr pool_;
+    bool rebound_ = false;  // moved off the processor's pool for good
+    MqmFairSchedulerPtr fair_;
+    size_t tenant_ = 0;
+    std::function<void()> task_;
+    State state_ = State::Idle;
+
+    // deadline: the first raise since the last run started + 'budget_'
+    // (zero budget: no deadline)
+    MqmDeadlineSchedulerPtr edf_;
+    MqmDeadlineScheduler::Clock::duration budget_{};
+    MqmDeadlineScheduler::Clock::time_point pending_;
+    bool hasPending_ = false;
+
+    void post()
     {
+        MqmThreadPoolPtr pool;
+        MqmFairSchedulerPtr fair;
+        size_t tenant = 0;
+        MqmDeadlineSchedulerPtr edf;
+        auto deadline = MqmDeadlineScheduler::Clock::time_point::max();
+        {
+            std::unique_lock<std::mutex> lock{ mtx_ };
+            pool = pool_;
+            fair = fair_;
+            tenant = tenant_;
+            edf = edf_;
+            if (budget_.count() && hasPending_)
+                deadline = pending_ + budget_;
+        }
+        auto self = shared_from_this();
+        if (edf)
+            return edf->post(deadline, [self]() { self->run(); });
+        if (fair)
+            return fair->post(tenant, [self]() { self->run(); });
+        pool->post([self]() { self->run(); });
+    }
+
+    void run()
+    {
+        {
+            std::unique_lock<std::mutex> lock{ mtx_ };
+            state_ = State::Running;
+            raised_ = false;
+            hasPending_ = false;
+        }
+        task_();
+
         std::unique_lock<std::mutex> lock{ mtx_ };
-        if (stopped_)
-            throw std::runtime_error("Can't enqueue, queue is stopped");
-        values_.emplace_back(std::move(v));
-        cv_.notify_one();
+        if (state_ != State::Rerun)
+        {
+            state_ = State::Idle;
+            return;
+        }
+        state_ = State::Scheduled;
+        lock.unlock();
+        post();
     }
 
-    void stop()
+public:
+    MqmSignal() = default;
+    explicit MqmSignal(const MqmThreadPoolPtr& pool) : pool_(pool) { }
+
+    void raise()
     {
         std::unique_lock<std::mutex> lock{ mtx_ };
-        stopped_ = true;
-        cv_.notify_one();
+        raised_ = true;
+        if (edf_ && !hasPending_)
+        {
+            pending_ = MqmDeadlineScheduler::Clock::now();
+            hasPending_ = true;
+        }
+        if (!pool_)
+            return cv_.notify_one();
+        if (!task_)
+            return;
+        if (state_ == State::Running)
+            state_ = State::Rerun;
+        if (state_ != State::Idle)
+            return;
+        state_ = State::Scheduled;
+        lock.unlock();
+        post();
     }
 
-    bool get(std::vector<Value>& values)
+    void wait()
     {
-        values.clear();
         std::unique_lock<std::mutex> lock{ mtx_ };
-        while (values_.empty() && !stopped_)
+        while (!raised_)
             cv_.wait(lock);
+        raised_ = false;
+    }
 
-        values_.swap(values);
-        return stopped_;
+    // pooled: the next runs go to 'pool', a current run finishes where it is;
+    // that leaves the tenant's fair share and deadline scheduling too,
+    // for good
+    void rebind(const MqmThreadPoolPtr& pool)
+    {
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        if (pool_ && pool)
+        {
+            pool_ = pool;
+            rebound_ = true;
+            fair_ = nullptr;
+            edf_ = nullptr;
+        }
+    }
+
+    // pooled: the next runs are queued on 'edf' (its pool) by deadline,
+    // a group takes the tightest non-zero budget of its keys
+    void deadline(const MqmDeadlineSchedulerPtr& edf, MqmDeadlineScheduler::Clock::duration budget)
+    {
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        if (!pool_ || rebound_)
+            return;
+        edf_ = edf;
+        if (budget.count() && (!budget_.count() || budget < budget_))
+            budget_ = budget;
+    }
+
+    // pooled: the next runs are queued as 'tenant' on 'fair' (its pool)
+    void fair(const MqmFairSchedulerPtr& fair, size_t tenant)
+    {
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        if (!pool_ || rebound_)
+            return;
+        fair_ = fair;
+        tenant_ = tenant;
+    }
+
+    // pooled: 'task' runs once per raise() from now on
+    void start(std::function<void()> task)
+    {
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        task_ = std::move(task);
+        if (!raised_)
+            return;
+        state_ = State::Scheduled;
+        lock.unlock();
+        post();
     }
 };
 
+using MqmSignalPtr = std::shared_ptr<MqmSignal>;
+
+// what a source drops once its backlog is over 'limit'
+enum class MqmShedPolicy
+{
+    None,
+    DropNewest,     // incoming values
+    DropOldest,     // the oldest pending ones
+    DropPriority,   // the lowest 'priority(value)' pending ones, oldest first on ties
+    CoDel           // incoming values, spaced by the CoDel control law while the
+                    // oldest pending value has waited over 'target' for 'interval'
+};
+
+// the backlog cap holds for every policy (CoDel drops newest at the cap);
+// DropOldest/DropPriority trim once 1/16 over the cap, so a drop costs
+// amortised O(1); a shared (competing) source only drops newest on a full ring
 template<typename Value>
-using MqmSourcePtr = std::shared_ptr<MqmSource<Value>>;
-template<typename Value>
-using MqmSourceWeak = std::weak_ptr<MqmSource<Value>>;
+struct MqmShedding
+{
+    MqmShedPolicy policy = MqmShedPolicy::None;
+    size_t limit = std::numeric_limits<size_t>::max();
+    std::function<int(const Value&)> priority;
+    std::chrono::microseconds target{ 5000 };
+    std::chrono::microseconds interval{ 100000 };
+};
 
-// consumers collection
-template<typename Key, typename Value>
-class MqmSink
+// data + signal + stopped flag
+// (a 'shared' source keeps its data in a lock-free ring instead,
+//  so that several competing drain tasks can pull from it)
+template<typename Value>
+class MqmSource
 {
-    std::vector<MqmConsumerPtr<Key, Value>> consumers_;
-    std::mutex consumersMtx_;
-    const Key key_;
+    using Clock = std::chrono::steady_clock;
+
+    std::vector<Value> values_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::atomic<bool> stopped_{ false };
+    MqmSignalPtr signal_;
 
-    std::vector<MqmConsumerPtr<Key, Value>> getConsumers()
+    // set once the key is subscribed to, until then
+    // only the newest 'orphanLimit_' values are kept (zero - all)
+    std::atomic<bool> subscribed_{ false };
+    size_t orphanLimit_ = 0;
+
+    // linger: get() holds on until 'minBatch_' values are pending
+    // or 'maxWait_' has passed since the oldest of them arrived
+    Clock::time_point first_;
+    size_t minBatch_ = 1;
+    Clock::duration maxWait_{};
+    MqmBatchControllerPtr control_;
+
+    // poke(): wakes the drain without data (due retries ...), every drain
+    // loop keeps the count it has seen, so a poke is never lost
+    size_t pokes_ = 0;
+    size_t seen_ = 0;
+
+    // load shedding, applied under mtx_ (CoDel keeps its dropping state here)
+    MqmShedding<Value> shed_;
+    std::atomic<size_t> dropped_{ 0 };
+    std::atomic<bool> dropWhenFull_{ false };
+    Clock::time_point firstAbove_{};
+    Clock::time_point dropNext_{};
+    size_t drops_ = 0;
+    std::vector<int> ranks_;
+    std::vector<int> sorted_;
+
+    // values over 'spillLimit_' pending go to disk, in order, and are paged
+    // back as the drain catches up (encode_/decode_ wrap MqmCodec, so only
+    // spilling sources need one)
+    std::unique_ptr<MqmSpill> spill_;
+    size_t spillLimit_ = 0;
+    std::function<void(const Value&, std::string&)> encode_;
+    std::function<Value(const char*, size_t)> decode_;
+    std::string record_;
+
+    // duplicates by message id are dropped before they are queued, under
+    // a lock of their own ('deduped_' keeps other keys off it), so shared
+    // sources are covered and the drain isn't held up
+    std::unique_ptr<MqmDedup> dedup_;
+    std::function<uint64_t(const Value&)> dedupId_;
+    std::mutex dedupMtx_;
+    std::atomic<bool> deduped_{ false };
+    std::atomic<size_t> duplicates_{ 0 };
+
+    // enqueue-side rate limit, published for admit() without the lock;
+    // replaced ones are kept until the source goes (limit() is rare)
+    struct Limit
     {
-        std::unique_lock<std::mutex> lock{ consumersMtx_ };
-        return consumers_;
+        MqmTokenBucketPtr bucket;
+        bool reject;
+    };
+    std::atomic<const Limit*> limit_{ nullptr };
+    std::vector<std::unique_ptr<const Limit>> limits_;
+
+    std::unique_ptr<MqmMpmcQueue<Value>> ring_;
+    std::atomic<bool> shared_{ false };
+    std::atomic<size_t> sleepers_{ 0 };
+    size_t quantum_ = 0;
+
+    // trims like MqmShedPolicy::DropOldest, the drops count as shedding ones
+    void orphanTrimLocked()
+    {
+        if (!orphanLimit_ || subscribed_.load(std::memory_order_relaxed))
+            return;
+        if (values_.size() <= orphanLimit_ + std::max<size_t>(orphanLimit_ / 16, 1))
+            return;
+        const size_t n = values_.size() - orphanLimit_;
+        dropped_ += n;
+        values_.erase(values_.begin(), values_.begin() + n);
     }
-public:
 
-    MqmSink(const Key& key) : key_(key) { }
+    // under mtx_, false - the incoming value is dropped
+    bool admitLocked(Clock::time_point now)
+    {
+        if (shed_.policy == MqmShedPolicy::None)
+            return true;
+        if ((shed_.policy == MqmShedPolicy::DropNewest || shed_.policy == MqmShedPolicy::CoDel)
+            && values_.size() >= shed_.limit)
+            return false;
+        if (shed_.policy != MqmShedPolicy::CoDel)
+            return true;
+
+        if (values_.empty() || now - first_ < shed_.target)
+        {
+            firstAbove_ = Clock::time_point{};
+            drops_ = 0;
+            return true;
+        }
+        if (firstAbove_ == Clock::time_point{})
+        {
+            firstAbove_ = now + shed_.interval;
+            return true;
+        }
+        if (now < firstAbove_ || (drops_ && now < dropNext_))
+            return true;
+
+        // interval / sqrt(drops): drops come faster while the delay stays high
+        ++drops_;
+        dropNext_ = now + std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double, std::micro>(shed_.interval.count() / std::sqrt(double(drops_))));
+        return false;
+    }
 
-    void subscribe(const MqmConsumerPtr<Key, Value>& consumer)
+    // under mtx_, false - 'v' stays in memory
+    bool spillLocked(const Value& v)
     {
-        std::unique_lock<std::mutex> lock{ consumersMtx_ };
-        consumers_.push_back(consumer);
+        if (!spill_ || (spill_->empty() && values_.size() < spillLimit_))
+            return false;
+        record_.clear();
+        encode_(v, record_);
+        spill_->append(record_.data(), record_.size());
+        return true;
     }
 
-    void consume(const std::vector<Value>& values)
+    // under mtx_, once the pending values were taken
+    void refillLocked()
     {
-        auto consumers = getConsumers();
-        for (auto& c : consumers)
-            for (auto& v : values)
-                try
-                {
-                    c->consume(key_, v);
-                }
-                catch (const std::exception& e)
+        if (!spill_ || spill_->empty())
+            return;
+        const char* data = nullptr;
+        size_t size = 0;
+        while (values_.size() < spillLimit_ && spill_->front(data, size))
+        {
+            values_.emplace_back(decode_(data, size));
+            spill_->pop();
+        }
+        first_ = Clock::now();
+        if (signal_)
+            signal_->raise();
+    }
+
+    // under mtx_, after values were added
+    void trimLocked()
+    {
+        if (shed_.policy != MqmShedPolicy::DropOldest && shed_.policy != MqmShedPolicy::DropPriority)
+            return;
+        if (values_.size() <= shed_.limit + std::max<size_t>(shed_.limit / 16, 1))
+            return;
+
+        const size_t n = values_.size() - shed_.limit;
+        dropped_ += n;
+        if (shed_.policy == MqmShedPolicy::DropOldest || !shed_.priority)
+        {
+            values_.erase(values_.begin(), values_.begin() + n);
+            return;
+        }
+
+        ranks_.clear();
+        for (auto& v : values_)
+            ranks_.push_back(shed_.priority(v));
+        sorted_ = ranks_;
+        std::nth_element(sorted_.begin(), sorted_.begin() + (n - 1), sorted_.end());
+        const int threshold = sorted_[n - 1];
+        size_t ties = n - std::count_if(ranks_.begin(), ranks_.end(), [threshold](int r) { return r < threshold; });
+
+        size_t kept = 0;
+        for (size_t i = 0; i < values_.size(); ++i)
+        {
+            if (ranks_[i] < threshold || (ranks_[i] == threshold && ties && ties--))
+                continue;
+            if (kept != i)
+                values_[kept] = std::move(values_[i]);
+            ++kept;
+        }
+        values_.erase(values_.begin() + kept, values_.end());
+    }
+
+    bool pop(std::vector<Value>& values)
+    {
+        while (values.size() < quantum_)
+            if (!ring_->pop(values))
+                break;
+        return !values.empty();
+    }
+
+    void enqueueShared(Value&& v)
+    {
+        if (stopped_)
+            throw std::runtime_error("Can't enqueue, queue is stopped");
+        auto dedupLock = lockDedup();
+        uint64_t hash = 0;
+        if (dedupLock && duplicate(v, hash))
+            return;
+        while (!ring_->push(std::move(v)))
+        {
+            if (dropWhenFull_.load(std::memory_order_relaxed))
+            {
+                ++dropped_;
+                return;
+            }
+            std::this_thread::yield();
+        }
+        if (dedupLock)
+        {
+            dedup_->remember(hash);
+            dedupLock.unlock();
+        }
+
+        // pairs with the fence in get(), either the sleeper sees the value
+        // or we see the sleeper
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers_.load(std::memory_order_relaxed))
+        {
+            std::unique_lock<std::mutex> lock{ mtx_ };
+            cv_.notify_one();
+        }
+    }
+
+    void enqueueShared(std::vector<Value>&& values)
+    {
+        if (stopped_)
+            throw std::runtime_error("Can't enqueue, queue is stopped");
+        auto dedupLock = lockDedup();
+        for (auto& v : values)
+        {
+            uint64_t hash = 0;
+            if (dedupLock && duplicate(v, hash))
+                continue;
+            bool pushed = true;
+            while (!ring_->push(std::move(v)))
+            {
+                if (dropWhenFull_.load(std::memory_order_relaxed))
                 {
-                    std::cout << "consumer error: " << e.what() << "\n";
+                    ++dropped_;
+                    pushed = false;
+                    break;
                 }
+                std::this_thread::yield();
+            }
+            if (dedupLock && pushed)
+                dedup_->remember(hash);
+        }
+        if (dedupLock)
+            dedupLock.unlock();
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers_.load(std::memory_order_relaxed))
+        {
+            std::unique_lock<std::mutex> lock{ mtx_ };
+            cv_.notify_all();
+        }
     }
-};
 
-template<typename Key, typename Value>
-using MqmSinkPtr = std::shared_ptr<MqmSink<Key, Value>>;
-template<typename Key, typename Value>
-using MqmSinkWeak = std::weak_ptr<MqmSink<Key, Value>>;
+    bool getShared(std::vector<Value>& values, size_t& seen)
+    {
+        if (pop(values))
+            return false;
 
-// consumers collection + std::future
-// (I wish it could be specified with some 'task-spawn-strategy',
-//  instead of std::async)
-template<typename Key, typename Value>
-class MqmActiveSink
-{
-    MqmSinkPtr<Key, Value> sink_;
-    std::future<void> task_;
-public:
-    MqmActiveSink(const Key& key)
-        : sink_(std::make_shared<MqmSink<Key, Value>>(key)) { }
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        ++sleepers_;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while (!pop(values) && !stopped_ && seen == pokes_)
+            cv_.wait(lock);
+        --sleepers_;
+        seen = pokes_;
+        return values.empty() && stopped_;
+    }
 
-    void subscribe(const MqmConsumerPtr<Key, Value>& consumer)
+    // held on dedupMtx_ when the source dedups, empty otherwise; an id is
+    // remembered only once its value is let in, so a rejected, stopped or
+    // shed value may be sent again
+    std::unique_lock<std::mutex> lockDedup()
     {
-        sink_->subscribe(consumer);
+        if (!deduped_.load(std::memory_order_acquire))
+            return std::unique_lock<std::mutex>{};
+        return std::unique_lock<std::mutex>{ dedupMtx_ };
     }
 
-    void start(const MqmSourcePtr<Value>& data)
+    // under dedupMtx_, 'hash' - the id to remember if the value is let in
+    bool duplicate(const Value& v, uint64_t& hash)
     {
-        MqmSourceWeak<Value> sourceWeak = data;
-        MqmSinkWeak<Key, Value> sinkWeak = sink_;
-        task_ = std::async(std::launch::async, [sourceWeak, sinkWeak]() {
-            std::vector<Value> values;
-            for (bool stopped = false; !stopped; )
-            try
-            {
-                auto source = sourceWeak.lock();
-                auto sink = sinkWeak.lock();
-                if (!source || !sink)
-                    return;
+        hash = dedupId_(v);
+        if (!dedup_->contains(hash))
+            return false;
+        ++duplicates_;
+        return true;
+    }
+
+    // drops the duplicates of a batch that is let in whole
+    void dedup(std::vector<Value>& values)
+    {
+        auto lock = lockDedup();
+        if (!lock)
+            return;
+        auto duplicate = [this](const Value& v) {
+            if (!dedup_->seen(dedupId_(v)))
+                return false;
+            ++duplicates_;
+            return true;
+        };
+        values.erase(std::remove_if(values.begin(), values.end(), duplicate), values.end());
+    }
+
+    // past the rate limit
+    void enqueueAdmitted(std::vector<Value>&& values)
+    {
+        if (shared_.load(std::memory_order_acquire))
+            return enqueueShared(std::move(values));
 
-                stopped = source->get(values);
-                sink->consume(values);
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        if (shared_.load(std::memory_order_relaxed))
+        {
+            lock.unlock();
+            return enqueueShared(std::move(values));
+        }
+        if (stopped_)
+            throw std::runtime_error("Can't enqueue, queue is stopped");
+        // the clock is read for the oldest value's arrival and for CoDel only
+        auto now = values_.empty() || shed_.policy == MqmShedPolicy::CoDel ? Clock::now() : Clock::time_point{};
+        if (!admitLocked(now))
+        {
+            // one drop per batch, the newest value (CoDel spaces drops in time)
+            values.pop_back();
+            ++dropped_;
+        }
+        if (shed_.policy == MqmShedPolicy::DropNewest || shed_.policy == MqmShedPolicy::CoDel)
+        {
+            size_t room = values_.size() < shed_.limit ? shed_.limit - values_.size() : 0;
+            if (values.size() > room)
+            {
+                dropped_ += values.size() - room;
+                values.erase(values.begin() + room, values.end());
             }
-            catch (const std::exception& e)
+        }
+        dedup(values);
+        if (spill_)
+        {
+            size_t room = spill_->empty() && values_.size() < spillLimit_ ? spillLimit_ - values_.size() : 0;
+            if (values.size() > room)
             {
-                std::cout << "task error: " << e.what() << "\n";
+                for (auto v = values.begin() + room; v != values.end(); ++v)
+                    spillLocked(*v);
+                values.erase(values.begin() + room, values.end());
             }
-        });
+        }
+        if (values.empty())
+            return;
+        bool wasEmpty = values_.empty();
+        if (wasEmpty)
+        {
+            first_ = now;
+            values_.swap(values);
+        }
+        else
+            values_.insert(values_.end(),
+                           std::make_move_iterator(values.begin()),
+                           std::make_move_iterator(values.end()));
+        trimLocked();
+        orphanTrimLocked();
+        if (wasEmpty || values_.size() >= minBatch_)
+            cv_.notify_one();
+        if (signal_ && wasEmpty)
+            signal_->raise();
     }
-};
 
-// sources collection + sinks collection 
-template<typename Key, typename Value>
-using MqmActiveSinkPtr = std::shared_ptr<MqmActiveSink<Key, Value>>;
+public:
+    // before the lock, a delayed producer doesn't hold up the others;
+    // the number of values let in, MqmLimitMode::Reject lets in as many
+    // as there are tokens for now
+    size_t admit(size_t count)
+    {
+        auto limit = limit_.load(std::memory_order_acquire);
+        if (!limit)
+            return count;
+        if (limit->reject)
+            return limit->bucket->tryTakeSome(count);
+        limit->bucket->take(count);
+        return count;
+    }
 
-template<typename Key, typename Value>
-class MqmProcessor
-{
-    std::map<Key, MqmSourcePtr<Value>> sources_;
-    std::mutex sourcesMtx_;
+    void enqueue(Value&& v)
+    {
+        if (!admit(1))
+            throw std::runtime_error("Can't enqueue, rate limit exceeded");
+        if (shared_.load(std::memory_order_acquire))
+            return enqueueShared(std::move(v));
 
-    std::map<Key, MqmActiveSinkPtr<Key, Value>> sinks_;
-    std::mutex sinksMtx_;
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        if (shared_.load(std::memory_order_relaxed))
+        {
+            lock.unlock();
+            return enqueueShared(std::move(v));
+        }
+        if (stopped_)
+            throw std::runtime_error("Can't enqueue, queue is stopped");
+        auto dedupLock = lockDedup();
+        uint64_t hash = 0;
+        if (dedupLock && duplicate(v, hash))
+            return;
+        auto now = values_.empty() || shed_.policy == MqmShedPolicy::CoDel ? Clock::now() : Clock::time_point{};
+        if (!admitLocked(now))
+        {
+            ++dropped_;
+            return;
+        }
+        if (dedupLock)
+        {
+            dedup_->remember(hash);
+            dedupLock.unlock();
+        }
+        if (spillLocked(v))
+            return;
+        // before trimming, a limit of 1 leaves one value in a queue
+        // that wasn't empty
+        bool wasEmpty = values_.empty();
+        if (wasEmpty)
+            first_ = now;
+        values_.emplace_back(std::move(v));
+        trimLocked();
+        orphanTrimLocked();
+        if (wasEmpty || values_.size() >= minBatch_)
+            cv_.notify_one();
+        if (signal_ && wasEmpty)
+            signal_->raise();
+    }
 
-    MqmSourcePtr<Value> getSource(const Key& key)
+    // one lock and one wakeup for the whole batch; over a MqmLimitMode::Reject
+    // limit the values that fit go in and the rest are left in 'values'
+    void enqueue(std::vector<Value>&& values)
     {
-        std::unique_lock<std::mutex> lock{ sourcesMtx_ };
-        auto ib = sources_.insert({key, nullptr});
-        if (ib.second)
-            ib.first->second = std::make_shared<MqmSource<Value>>();;
-        return ib.first->second;
+        if (values.empty())
+            return;
+        size_t admitted = admit(values.size());
+        if (admitted == values.size())
+            return enqueueAdmitted(std::move(values));
+
+        std::vector<Value> rejected(std::make_move_iterator(values.begin() + admitted),
+                                    std::make_move_iterator(values.end()));
+        values.erase(values.begin() + admitted, values.end());
+        if (!values.empty())
+            enqueueAdmitted(std::move(values));
+        values = std::move(rejected);
+        throw std::runtime_error("Can't enqueue, rate limit exceeded");
     }
 
-    void removeSource(const Key& key)
+    // enqueue() for a thread that mustn't wait (the timer's): over a
+    // MqmLimitMode::Delay limit the values there are tokens for now go in
+    // and the rest are left in 'values', returns when tokens are due for them
+    Clock::duration enqueueNow(std::vector<Value>& values)
     {
-        std::unique_lock<std::mutex> lock{ sourcesMtx_ };
-        auto i = sources_.find(key);
-        if (i == sources_.end())
+        auto limit = limit_.load(std::memory_order_acquire);
+        if (!limit || limit->reject)
+        {
+            enqueue(std::move(values));
+            values.clear();
+            return {};
+        }
+        size_t admitted = limit->bucket->tryTakeSome(values.size());
+        std::vector<Value> rest(std::make_move_iterator(values.begin() + admitted),
+                                std::make_move_iterator(values.end()));
+        values.erase(values.begin() + admitted, values.end());
+        if (!values.empty())
+            enqueueAdmitted(std::move(values));
+        values = std::move(rest);
+        return values.empty() ? Clock::duration{} : limit->bucket->wait(values.size());
+    }
+
+    void shed(const MqmShedding<Value>& shedding)
+    {
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        shed_ = shedding;
+        firstAbove_ = Clock::time_point{};
+        drops_ = 0;
+        dropWhenFull_.store(shedding.policy != MqmShedPolicy::None, std::memory_order_relaxed);
+    }
+
+    // pending values over 'limit' go to mmap'ed segment files in 'directory'
+    // instead of memory, with no syscall per value (Value needs an MqmCodec);
+    // the drain gets them back in order, at most 'limit' per batch;
+    // not for shared (competing) sources, share() takes the spilled ones back
+    void spill(const std::string& directory, size_t limit, size_t segmentSize = size_t(64) << 20)
+    {
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        if (shared_)
+            throw std::runtime_error("Can't spill, source is shared");
+        if (spill_)
+            throw std::runtime_error("Can't spill, source already spills");
+        spill_.reset(new MqmSpill(directory, segmentSize));
+        spillLimit_ = std::max<size_t>(limit, 1);
+        encode_ = [](const Value& v, std::string& out) { MqmCodec<Value>::write(v, out); };
+        decode_ = [](const char* data, size_t size) { return MqmCodec<Value>::read(data, size); };
+    }
+
+    // values dropped by shedding so far
+    size_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+    // the pending values of a source as taken out for a snapshot:
+    // in memory, then spilled ones still encoded
+    struct Pending
+    {
+        std::vector<Value> values;
+        std::unique_ptr<MqmSpill> spill;
+
+        size_t size() const { return values.size() + (spill ? spill->records() : 0); }
+    };
+
+    // moves every pending value out, in order; a spilling source
+    // goes on spilling to a new log
+    Pending takeAll()
+    {
+        Pending pending;
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        pending.values.swap(values_);
+        if (ring_)
+            while (ring_->pop(pending.values))
+                ;
+        if (spill_ && !spill_->empty())
+        {
+            pending.spill = std::move(spill_);
+            spill_.reset(new MqmSpill(pending.spill->directory(), pending.spill->segmentSize()));
+        }
+        return pending;
+    }
+
+    // puts values taken by takeAll() back ahead of the ones enqueued since
+    // (some of those may have been consumed already)
+    void putBack(Pending&& pending)
+    {
+        if (shared_.load(std::memory_order_acquire))
+        {
+            // the ring is drained without the lock, back of the queue then
+            const char* data = nullptr;
+            size_t size = 0;
+            while (pending.spill && pending.spill->front(data, size))
+            {
+                pending.values.emplace_back(decode_(data, size));
+                pending.spill->pop();
+            }
+            for (auto& v : pending.values)
+                while (!ring_->push(std::move(v)))
+                {
+                    if (stopped_ || dropWhenFull_.load(std::memory_order_relaxed))
+                    {
+                        ++dropped_;
+                        break;
+                    }
+                    std::this_thread::yield();
+                }
+            poke();
             return;
-        i->second->stop();
-        sources_.erase(i);
+        }
+
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        if (pending.spill)
+        {
+            // the newer values go behind the spilled ones, into their log
+            for (auto& v : values_)
+            {
+                record_.clear();
+                encode_(v, record_);
+                pending.spill->append(record_.data(), record_.size());
+            }
+            const char* data = nullptr;
+            size_t size = 0;
+            while (spill_ && spill_->front(data, size))
+            {
+                pending.spill->append(data, size);
+                spill_->pop();
+            }
+            values_.clear();
+            spill_ = std::move(pending.spill);
+        }
+        bool wasEmpty = values_.empty();
+        pending.values.insert(pending.values.end(),
+                              std::make_move_iterator(values_.begin()),
+                              std::make_move_iterator(values_.end()));
+        values_.swap(pending.values);
+        if (values_.empty())
+            refillLocked();
+        else if (wasEmpty)
+        {
+            first_ = Clock::now();
+            if (signal_)
+                signal_->raise();
+        }
+        cv_.notify_all();
     }
 
-    MqmActiveSinkPtr<Key, Value> getSink(const Key& key, bool& created)
+    // values pending while nobody is subscribed, over 'limit' the oldest are dropped
+    void orphans(size_t limit)
     {
-        std::unique_lock<std::mutex> lock{ sinksMtx_ };
-        auto ib = sinks_.insert({ key, nullptr });
-        created = ib.second;
-        if (ib.second)
-            ib.first->second = std::make_shared<MqmActiveSink<Key, Value>>(key);
-        return ib.first->second;
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        orphanLimit_ = limit;
+        orphanTrimLocked();
     }
 
-    void removeSink(const Key& key)
+    void subscribe()
     {
-        std::unique_lock<std::mutex> lock{ sinksMtx_ };
-        sinks_.erase(key);
+        subscribed_.store(true, std::memory_order_release);
     }
 
-public:
-    ~MqmProcessor()
+    bool subscribed() const { return subscribed_.load(std::memory_order_acquire); }
+
+    // drops values whose 'hash' (see mqmDedupHash) was seen within 'window',
+    // 'capacity' - ids expected per window, see MqmDedup
+    void dedup(const std::function<uint64_t(const Value&)>& hash,
+               std::chrono::milliseconds window, size_t capacity, bool exact)
     {
-        for (auto& s : sources_)
-            s.second->stop();
+        std::unique_lock<std::mutex> lock{ dedupMtx_ };
+        if (dedup_)
+            throw std::runtime_error("Can't dedup, source already dedups");
+        dedup_.reset(new MqmDedup(window, capacity, exact));
+        dedupId_ = hash;
+        deduped_.store(true, std::memory_order_release);
     }
 
-    void subscribe(const Key& key, const MqmConsumerPtr<Key, Value>& consumer)
+    // values dropped as duplicates so far
+    size_t duplicates() const { return duplicates_.load(std::memory_order_relaxed); }
+
+    // MqmLimitMode::Reject or Delay, a bucket may be shared by several sources
+    void limit(const MqmTokenBucketPtr& bucket, bool reject)
     {
-        bool created{};
-        auto sink = getSink(key, created);
-        sink->subscribe(consumer);
-        if (created)
-            sink->start(getSource(key));
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        if (!bucket)
+            return limit_.store(nullptr, std::memory_order_release);
+        limits_.emplace_back(new Limit{ bucket, reject });
+        limit_.store(limits_.back().get(), std::memory_order_release);
     }
 
-    void unsubscribe(const Key& key)
+    // the source is drained by tryGet() of a group task then,
+    // 'signal' is raised whenever the source turns non-empty or stops
+    void attach(const MqmSignalPtr& signal)
     {
-        removeSource(key);
-        removeSink(key);
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        signal_ = signal;
+        if (!values_.empty() || stopped_)
+            signal_->raise();
     }
 
-    void enqueue(const Key& key, Value&& value)
+    // switch to the competing-consumers mode,
+    // values pending so far are moved into the ring, spilled ones too
+    // (the source stops spilling then); a ring of 'capacity' (a power of two)
+    // is doubled until the backlog fits
+    void share(size_t capacity, size_t quantum)
+    {
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        if (shared_)
+            return;
+        // decoded first, a throwing MqmCodec leaves the source as it was
+        std::vector<Value> spilled;
+        if (spill_)
+            spill_->read([&](const char* data, size_t size) { spilled.push_back(decode_(data, size)); });
+        while (capacity < values_.size() + spilled.size())
+            capacity <<= 1;
+        auto ring = std::make_unique<MqmMpmcQueue<Value>>(capacity);
+        for (auto& v : values_)
+            ring->push(std::move(v));
+        for (auto& v : spilled)
+            ring->push(std::move(v));
+        values_.clear();
+        spill_.reset();
+        ring_ = std::move(ring);
+        quantum_ = quantum;
+        shared_.store(true, std::memory_order_release);
+    }
+
+    // applies to the blocking get() of a source that is not shared,
+    // grouped or pooled sources are drained with tryGet()
+    void linger(size_t minBatch, std::chrono::microseconds maxWait)
+    {
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        minBatch_ = std::max<size_t>(minBatch, 1);
+        maxWait_ = maxWait;
+        cv_.notify_all();
+    }
+
+    // the drain task slices batches and tunes linger through 'control'
+    void adapt(const MqmBatchControllerPtr& control)
+    {
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        control_ = control;
+    }
+
+    MqmBatchControllerPtr control()
+    {
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        return control_;
+    }
+
+    void poke()
+    {
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        ++pokes_;
+        cv_.notify_all();
+        if (signal_)
+            signal_->raise();
+    }
+
+    void stop()
+    {
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        stopped_ = true;
+        cv_.notify_all();
+        if (signal_)
+            signal_->raise();
+    }
+
+    // shared mode: takes up to 'quantum' values and reports 'stopped'
+    // only once the ring is drained, so that every value is handed out
+    bool get(std::vector<Value>& values)
+    {
+        Clock::time_point since;
+        return get(values, since, seen_);
+    }
+
+    // 'since' - arrival of the oldest value of the batch,
+    // 'seen' - pokes seen by the calling drain loop, values may come back empty on a poke
+    bool get(std::vector<Value>& values, Clock::time_point& since, size_t& seen)
+    {
+        values.clear();
+        if (shared_.load(std::memory_order_acquire))
+            return getShared(values, seen);
+
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        for (;;)
+        {
+            while (values_.empty() && !stopped_ && seen == pokes_)
+                cv_.wait(lock);
+            if (values_.size() >= minBatch_ || stopped_ || values_.empty())
+                break;
+            if (cv_.wait_until(lock, first_ + maxWait_) == std::cv_status::timeout && !values_.empty())
+                break;
+        }
+
+        seen = pokes_;
+        since = first_;
+        values_.swap(values);
+        refillLocked();
+        return stopped_ && values_.empty();
+    }
+
+    // never blocks, 'values' may come back empty
+    bool tryGet(std::vector<Value>& values)
+    {
+        Clock::time_point since;
+        return tryGet(values, since);
+    }
+
+    bool tryGet(std::vector<Value>& values, Clock::time_point& since)
+    {
+        values.clear();
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        since = first_;
+        values_.swap(values);
+        refillLocked();
+        return stopped_ && values_.empty();
+    }
+};
+
+template<typename Value>
+using MqmSourcePtr = std::shared_ptr<MqmSource<Value>>;
+template<typename Value>
+using MqmSourceWeak = std::weak_ptr<MqmSource<Value>>;
+
+// what happens to the values a consumer throws on
+template<typename Key>
+struct MqmRetry
+{
+    size_t attempts = 0;                            // retries before giving up
+    std::chrono::milliseconds backoff{ 0 };         // 0 - retried right after the batch,
+    std::chrono::milliseconds maxBackoff{ 10000 };  // else doubled per attempt, via the timer
+    bool deadLetter = false;                        // given up values go to 'deadKey',
+    Key deadKey{};                                  // one batch per pass
+};
+
+// MqmRetry + the processor's means to carry it out
+template<typename Key, typename Value>
+struct MqmRecovery
+{
+    MqmRetry<Key> retry;
+    MqmTimerPtr timer;
+    std::function<void(const Key&, std::vector<Value>&&)> enqueue;
+};
+
+template<typename Key, typename Value>
+using MqmRecoveryPtr = std::shared_ptr<MqmRecovery<Key, Value>>;
+
+// consumers collection
+// (large batches for order-insensitive consumers are split into chunks
+//  and forked onto the pool, joined before the next batch)
+template<typename Key, typename Value>
+class MqmSink
+{
+    // retries due from the timer, by the number of retries done so far
+    struct Retries
+    {
+        std::mutex mtx;
+        std::vector<std::pair<size_t, std::vector<Value>>> due;
+    };
+
+    struct Subscription
+    {
+        MqmConsumerPtr<Key, Value> consumer;
+        MqmRecoveryPtr<Key, Value> recovery;
+        std::shared_ptr<Retries> retries;
+        bool snapshot = false;  // the key's latest value is due before its next ones
+    };
+
+    std::vector<Subscription> consumers_;
+    std::mutex consumersMtx_;
+    const Key key_;
+    const MqmThreadPoolPtr pool_;
+    const size_t chunk_;
+    const MqmHeartbeatPtr heartbeat_ = std::make_shared<MqmHeartbeat>();
+    MqmSourceWeak<Value> source_;
+    MqmTokenBucketPtr pace_;
+    MqmLatestPtr<Value> latest_;
+
+    // snapshots due are handed out once
+    std::vector<Subscription> getConsumers(MqmTokenBucketPtr& pace, MqmLatestPtr<Value>& latest)
+    {
+        std::unique_lock<std::mutex> lock{ consumersMtx_ };
+        pace = pace_;
+        latest = latest_;
+        auto consumers = consumers_;
+        for (auto& s : consumers_)
+            s.snapshot = false;
+        return consumers;
+    }
+
+    // move-only values can't be kept for a retry
+    static void keep(std::vector<Value>& failed, const Value& v, std::true_type) { failed.push_back(v); }
+    static void keep(std::vector<Value>&, const Value&, std::false_type) { }
+
+    // nor cached as the latest one
+    static void remember(MqmLatest<Value>& latest, const Value& v, std::true_type) { latest.store(v); }
+    static void remember(MqmLatest<Value>&, const Value&, std::false_type) { }
+
+    void snapshot(const Subscription& s, const MqmLatest<Value>& latest,
+                  std::vector<Value>& failed, std::mutex& failedMtx, std::true_type)
+    {
+        latest.read([&](const Value& v) { consume(s, &v, &v + 1, failed, failedMtx); });
+    }
+
+    void snapshot(const Subscription&, const MqmLatest<Value>&,
+                  std::vector<Value>&, std::mutex&, std::false_type) { }
+
+    void consume(const Subscription& s, const Value* begin, const Value* end,
+                 std::vector<Value>& failed, std::mutex& failedMtx)
+    {
+        auto& c = s.consumer;
+        std::unique_ptr<MqmThreadPool::Blocking> blocking;
+        if (c->blocking())
+            blocking = std::make_unique<MqmThreadPool::Blocking>();
+        if (c->batched())
+        {
+            try
+            {
+                c->consumeBatch(key_, begin, end);
+            }
+            catch (const std::exception& e)
+            {
+                std::cout << "consumer error: " << e.what() << "\n";
+                if (!s.recovery)
+                    return;
+                std::unique_lock<std::mutex> lock{ failedMtx };
+                for (auto v = begin; v != end; ++v)
+                    keep(failed, *v, std::is_copy_constructible<Value>());
+            }
+            return;
+        }
+        for (auto v = begin; v != end; ++v)
+            try
+            {
+                c->consume(key_, *v);
+            }
+            catch (const std::exception& e)
+            {
+                std::cout << "consumer error: " << e.what() << "\n";
+                if (!s.recovery)
+                    continue;
+                std::unique_lock<std::mutex> lock{ failedMtx };
+                keep(failed, *v, std::is_copy_constructible<Value>());
+            }
+    }
+
+    // 'failed' after 'retried' retries: retried now, scheduled, or given up
+    void recover(const Subscription& s, std::vector<Value>&& failed, size_t retried)
+    {
+        auto& retry = s.recovery->retry;
+        std::mutex failedMtx;
+        while (!failed.empty() && retried < retry.attempts && retry.backoff.count() == 0)
+        {
+            std::vector<Value> again;
+            again.swap(failed);
+            consume(s, again.data(), again.data() + again.size(), failed, failedMtx);
+            ++retried;
+        }
+        if (failed.empty())
+            return;
+
+        if (retried < retry.attempts)
+        {
+            auto delay = std::min(retry.backoff * (int64_t(1) << std::min<size_t>(retried, 30)), retry.maxBackoff);
+            auto values = std::make_shared<std::vector<Value>>(std::move(failed));
+            std::weak_ptr<Retries> retriesWeak = s.retries;
+            MqmSourceWeak<Value> sourceWeak = source_;
+            s.recovery->timer->schedule(delay, [retriesWeak, sourceWeak, values, retried]() {
+                auto retries = retriesWeak.lock();
+                auto source = sourceWeak.lock();
+                if (!retries || !source)
+                    return;
+                {
+                    std::unique_lock<std::mutex> lock{ retries->mtx };
+                    retries->due.emplace_back(retried + 1, std::move(*values));
+                }
+                source->poke();
+            });
+            return;
+        }
+
+        if (!retry.deadLetter)
+        {
+            std::cout << "consumer gave up on " << failed.size() << " values\n";
+            return;
+        }
+        try
+        {
+            s.recovery->enqueue(retry.deadKey, std::move(failed));
+        }
+        catch (const std::exception& e)
+        {
+            std::cout << "dead letter error: " << e.what() << "\n";
+        }
+    }
+
+    // retries handed back by the timer
+    void retry(const std::vector<Subscription>& consumers)
+    {
+        std::mutex failedMtx;
+        for (auto& s : consumers)
+        {
+            if (!s.retries)
+                continue;
+            std::vector<std::pair<size_t, std::vector<Value>>> due;
+            {
+                std::unique_lock<std::mutex> lock{ s.retries->mtx };
+                due.swap(s.retries->due);
+            }
+            for (auto& d : due)
+            {
+                std::vector<Value> failed;
+                consume(s, d.second.data(), d.second.data() + d.second.size(), failed, failedMtx);
+                recover(s, std::move(failed), d.first);
+            }
+        }
+    }
+
+public:
+
+    MqmSink(const Key& key, const MqmThreadPoolPtr& pool = nullptr, size_t chunk = 0)
+        : key_(key)
+        , pool_(pool)
+        , chunk_(chunk) { }
+
+    // 'snapshot': the consumer gets the key's latest value on the next
+    // drain (the source is poked for it), ahead of the values after it
+    void subscribe(const MqmConsumerPtr<Key, Value>& consumer,
+                   const MqmRecoveryPtr<Key, Value>& recovery = nullptr, bool snapshot = false)
+    {
+        std::unique_lock<std::mutex> lock{ consumersMtx_ };
+        consumers_.push_back({ consumer, recovery,
+                               recovery ? std::make_shared<Retries>() : nullptr, snapshot });
+    }
+
+    // the source timed retries poke
+    void bind(const MqmSourcePtr<Value>& source)
+    {
+        std::unique_lock<std::mutex> lock{ consumersMtx_ };
+        source_ = source;
+    }
+
+    // MqmLimitMode::Pace: batches are dispatched in slices of at most
+    // the bucket's burst, each waiting for its tokens first
+    void pace(const MqmTokenBucketPtr& bucket)
+    {
+        std::unique_lock<std::mutex> lock{ consumersMtx_ };
+        pace_ = bucket;
+    }
+
+    // the last value of every dispatch is stored into 'latest'
+    void latest(const MqmLatestPtr<Value>& latest)
+    {
+        std::unique_lock<std::mutex> lock{ consumersMtx_ };
+        latest_ = latest;
+    }
+
+    void consume(const std::vector<Value>& values)
+    {
+        consume(values.data(), values.data() + values.size());
+    }
+
+    // batch sliced and measured for an adaptive key,
+    // 'since' - arrival of the oldest value
+    void consume(const std::vector<Value>& values, MqmBatchController& control,
+                 MqmBatchController::Clock::time_point since)
+    {
+        using Clock = MqmBatchController::Clock;
+
+        if (values.empty())
+            return consume(values.data(), values.data());
+        const Value* data = values.data();
+        const Value* end = data + values.size();
+        while (data != end)
+        {
+            const Value* next = data + std::min<size_t>(control.batch(), end - data);
+            auto start = Clock::now();
+            consume(data, next);
+            auto done = Clock::now();
+            control.record(start - since, done - start);
+            data = next;
+        }
+    }
+
+    MqmHeartbeatPtr heartbeat() const { return heartbeat_; }
+
+    void consume(const Value* data, const Value* end)
+    {
+        MqmFairScheduler::charge(end - data);
+        MqmTokenBucketPtr pace;
+        MqmLatestPtr<Value> latest;
+        auto consumers = getConsumers(pace, latest);
+        if (!pace || data == end)
+            return dispatch(consumers, latest, data, end);
+
+        while (data != end)
+        {
+            const Value* next = data + std::min<size_t>(pace->burst(), end - data);
+            pace->take(next - data);
+            dispatch(consumers, latest, data, next);
+            for (auto& s : consumers)
+                s.snapshot = false;
+            data = next;
+        }
+    }
+
+private:
+    void dispatch(const std::vector<Subscription>& consumers, const MqmLatestPtr<Value>& latest,
+                  const Value* data, const Value* end)
+    {
+        const size_t size = end - data;
+        heartbeat_->start();
+        retry(consumers);
+        std::vector<Value> failed;
+        std::mutex failedMtx;
+        for (auto& s : consumers)
+        {
+            if (s.snapshot && latest)
+                snapshot(s, *latest, failed, failedMtx, std::is_copy_constructible<Value>());
+            auto& c = s.consumer;
+            if (!pool_ || !chunk_ || size < 2 * chunk_ || c->ordered() || c->blocking() || c->batched())
+                consume(s, data, data + size, failed, failedMtx);
+            else
+            {
+                size_t chunks = (size + chunk_ - 1) / chunk_;
+                pool_->run(chunks, [&](size_t i) {
+                    consume(s, data + i * chunk_, data + std::min(size, (i + 1) * chunk_), failed, failedMtx);
+                });
+            }
+            if (!failed.empty())
+                recover(s, std::move(failed), 0);
+            failed.clear();
+        }
+        if (latest && size)
+            remember(*latest, end[-1], std::is_copy_constructible<Value>());
+        heartbeat_->stop();
+    }
+};
+
+template<typename Key, typename Value>
+using MqmSinkPtr = std::shared_ptr<MqmSink<Key, Value>>;
+template<typename Key, typename Value>
+using MqmSinkWeak = std::weak_ptr<MqmSink<Key, Value>>;
+
+// how the values of one key are spread among its consumers
+enum class MqmDelivery
+{
+    Broadcast, // every consumer gets every value, one drain task
+    Compete    // each value goes to exactly one consumer, drain task per consumer
+};
+
+// what enqueue() does with the values of a key nobody subscribed to (yet)
+enum class MqmOrphanPolicy
+{
+    Buffer, // queued for a later subscriber, optionally only the newest ones
+    Drop,   // counted and dropped, no source is created for the key
+    Route   // handed to a default handler, no source is created for the key
+};
+
+// several keys drained by one task, so consumers subscribed to the group
+// are never called concurrently and may keep plain (non-atomic) state;
+// the task is a dedicated thread, or pool runs triggered by the member sources
+template<typename Key, typename Value>
+class MqmActiveGroup
+{
+    // sinks are held until their source stops, so the last batch
+    // is consumed even when the owning MqmActiveSink is already gone
+    struct Member
+    {
+        MqmSourceWeak<Value> source;
+        MqmSinkPtr<Key, Value> sink;
+    };
+
+    struct Drain
+    {
+        std::vector<Member> members;
+        std::vector<Value> values;
+        std::promise<void> done;
+    };
+
+    const MqmThreadPoolPtr pool_;
+    std::vector<Member> members_;
+    MqmSignalPtr signal_;
+    std::future<void> task_;
+
+    // one pass over the members, stopped ones are dropped
+    static void drain(std::vector<Member>& members, std::vector<Value>& values)
+    {
+        for (auto i = members.begin(); i != members.end(); )
+        {
+            bool stopped = true;
+            try
+            {
+                if (auto source = i->source.lock())
+                {
+                    MqmBatchController::Clock::time_point since;
+                    stopped = source->tryGet(values, since);
+                    if (auto control = source->control())
+                        i->sink->consume(values, *control, since);
+                    else
+                        i->sink->consume(values);
+                }
+            }
+            catch (const std::exception& e)
+            {
+                std::cout << "task error: " << e.what() << "\n";
+            }
+            i = stopped ? members.erase(i) : i + 1;
+        }
+    }
+
+public:
+    explicit MqmActiveGroup(const MqmThreadPoolPtr& pool = nullptr)
+        : pool_(pool)
+        , signal_(std::make_shared<MqmSignal>(pool)) { }
+
+    // waits for the last batches, as std::async's future would
+    ~MqmActiveGroup()
+    {
+        if (task_.valid())
+            task_.wait();
+    }
+
+    // pooled group only
+    void rebind(const MqmThreadPoolPtr& pool)
+    {
+        if (pool_)
+            signal_->rebind(pool);
+    }
+
+    void fair(const MqmFairSchedulerPtr& fair, size_t tenant)
+    {
+        signal_->fair(fair, tenant);
+    }
+
+    void deadline(const MqmDeadlineSchedulerPtr& edf, MqmDeadlineScheduler::Clock::duration budget)
+    {
+        signal_->deadline(edf, budget);
+    }
+
+    // all members are added before start()
+    void add(const MqmSourcePtr<Value>& source, const MqmSinkPtr<Key, Value>& sink)
+    {
+        sink->bind(source);
+        members_.push_back({ source, sink });
+        source->attach(signal_);
+    }
+
+    void start()
+    {
+        auto signal = signal_;
+        if (!pool_)
+        {
+            task_ = std::async(std::launch::async, [members = members_, signal]() mutable {
+                std::vector<Value> values;
+                while (!members.empty())
+                {
+                    signal->wait();
+                    drain(members, values);
+                }
+            });
+            return;
+        }
+
+        auto state = std::make_shared<Drain>();
+        state->members = members_;
+        task_ = state->done.get_future();
+        if (state->members.empty())
+            return state->done.set_value();
+        signal->start([state]() {
+            if (state->members.empty())
+                return;
+            drain(state->members, state->values);
+            if (state->members.empty())
+                state->done.set_value();
+        });
+    }
+};
+
+template<typename Key, typename Value>
+using MqmActiveGroupPtr = std::shared_ptr<MqmActiveGroup<Key, Value>>;
+
+// consumers collection + std::future
+// (with a pool the key runs as a pooled group of one instead,
+//  competing consumers keep their own std::async tasks)
+template<typename Key, typename Value>
+class MqmActiveSink
+{
+    const Key key_;
+    const MqmDelivery delivery_;
+    const MqmThreadPoolPtr pool_;
+    const size_t chunk_;
+    const MqmActiveGroupPtr<Key, Value> group_;
+    const bool ownGroup_;
+    std::vector<MqmSinkPtr<Key, Value>> sinks_;
+    std::vector<std::future<void>> tasks_;
+    MqmSourceWeak<Value> source_;
+    MqmWatchdogPtr<Key> watchdog_;
+    MqmTokenBucketPtr pace_;
+    MqmLatestPtr<Value> latest_;
+    std::mutex mtx_;
+
+    // one batch, sliced and measured when the key is adaptive
+    static bool drain(MqmSource<Value>& source, MqmSink<Key, Value>& sink,
+                      std::vector<Value>& values, size_t& seen)
+    {
+        using Clock = MqmBatchController::Clock;
+
+        Clock::time_point since;
+        bool stopped = source.get(values, since, seen);
+        auto control = source.control();
+        if (!control)
+        {
+            sink.consume(values);
+            return stopped;
+        }
+
+        size_t batch = control->batch();
+        auto linger = control->linger();
+        sink.consume(values, *control, since);
+        if (batch != control->batch() || linger != control->linger())
+            source.linger(control->batch(), control->linger());
+        return stopped;
+    }
+
+    void spawn(const MqmSinkPtr<Key, Value>& sink)
+    {
+        sink->bind(source_.lock());
+        MqmSourceWeak<Value> sourceWeak = source_;
+        MqmSinkWeak<Key, Value> sinkWeak = sink;
+        tasks_.push_back(std::async(std::launch::async, [sourceWeak, sinkWeak]() {
+            std::vector<Value> values;
+            size_t seen = 0;
+            for (bool stopped = false; !stopped; )
+            try
+            {
+                auto source = sourceWeak.lock();
+                auto sink = sinkWeak.lock();
+                if (!source || !sink)
+                    return;
+
+                stopped = drain(*source, *sink, values, seen);
+            }
+            catch (const std::exception& e)
+            {
+                std::cout << "task error: " << e.what() << "\n";
+            }
+        }));
+    }
+
+public:
+    MqmActiveSink(const Key& key, MqmDelivery delivery,
+                  const MqmThreadPoolPtr& pool = nullptr, size_t chunk = 0,
+                  const MqmActiveGroupPtr<Key, Value>& group = nullptr)
+        : key_(key)
+        , delivery_(delivery)
+        , pool_(pool)
+        , chunk_(chunk)
+        , group_(group || !pool || delivery != MqmDelivery::Broadcast
+                     ? group : std::make_shared<MqmActiveGroup<Key, Value>>(pool))
+        , ownGroup_(group_ != group)
+    {
+        if (delivery_ == MqmDelivery::Broadcast)
+            sinks_.push_back(std::make_shared<MqmSink<Key, Value>>(key, pool_, chunk_));
+    }
+
+    MqmDelivery delivery() const { return delivery_; }
+
+    // a blocking consumer moves the whole pooled context onto 'blockingPool'
+    // 'snapshot' - broadcast only, see MqmSink::subscribe
+    void subscribe(const MqmConsumerPtr<Key, Value>& consumer,
+                   const MqmThreadPoolPtr& blockingPool = nullptr,
+                   const MqmRecoveryPtr<Key, Value>& recovery = nullptr, bool snapshot = false)
+    {
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        if (group_ && blockingPool && consumer->blocking())
+            group_->rebind(blockingPool);
+        if (delivery_ == MqmDelivery::Broadcast)
+            return sinks_.front()->subscribe(consumer, recovery, snapshot);
+
+        auto sink = std::make_shared<MqmSink<Key, Value>>(key_, pool_, chunk_);
+        sink->subscribe(consumer, recovery);
+        sink->pace(pace_);
+        sink->latest(latest_);
+        sinks_.push_back(sink);
+        if (watchdog_)
+            watchdog_->watch(key_, sink->heartbeat());
+        if (!source_.expired())
+            spawn(sink);
+    }
+
+    void watch(const MqmWatchdogPtr<Key>& watchdog)
+    {
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        watchdog_ = watchdog;
+        for (auto& sink : sinks_)
+            watchdog_->watch(key_, sink->heartbeat());
+    }
+
+    void pace(const MqmTokenBucketPtr& bucket)
+    {
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        pace_ = bucket;
+        for (auto& sink : sinks_)
+            sink->pace(pace_);
+    }
+
+    void latest(const MqmLatestPtr<Value>& latest)
+    {
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        latest_ = latest;
+        for (auto& sink : sinks_)
+            sink->latest(latest_);
+    }
+
+    // pooled contexts only
+    void rebind(const MqmThreadPoolPtr& pool)
+    {
+        if (group_)
+            group_->rebind(pool);
+    }
+
+    // pooled contexts only, a group goes with the tenant of its last key set
+    void fair(const MqmFairSchedulerPtr& fair, size_t tenant)
+    {
+        if (group_)
+            group_->fair(fair, tenant);
+    }
+
+    // pooled contexts only
+    void deadline(const MqmDeadlineSchedulerPtr& edf, MqmDeadlineScheduler::Clock::duration budget)
+    {
+        if (group_)
+            group_->deadline(edf, budget);
+    }
+
+    void start(const MqmSourcePtr<Value>& data)
+    {
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        source_ = data;
+        if (group_)
+        {
+            group_->add(data, sinks_.front());
+            if (ownGroup_)
+                group_->start();
+            return;
+        }
+        for (auto& sink : sinks_)
+            spawn(sink);
+    }
+};
+
+// MqmWindowConsumer without an event time extractor: values are
+// stamped when their batch is drained
+struct MqmProcessingTime { };
+
+// time of 'v' since its clock's epoch, 'now' (the drain time) for processing time
+template<typename Value>
+std::chrono::nanoseconds mqmEventTime(MqmProcessingTime&, const Value&, std::chrono::nanoseconds now)
+{
+    return now;
+}
+
+template<typename TimeOf, typename Value>
+std::chrono::nanoseconds mqmEventTime(TimeOf& timeOf, const Value& v, std::chrono::nanoseconds)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(timeOf(v).time_since_epoch());
+}
+
+// windowed aggregation stage of one key (see MqmWindow): batches run through
+// the window without a virtual call per value and only aggregates are emitted,
+// 'emit(key, window start, agg)';
+// 'TimeOf' maps a value to its event time (a time_point of any clock),
+// windows close as newer events arrive and older values are dropped as late;
+// processing time windows also close on the drain's ticks, without data
+template<typename Key, typename Value, typename Agg, typename TimeOf = MqmProcessingTime>
+class MqmWindowConsumer : public MqmConsumer<Key, Value>
+{
+public:
+    using Emit = std::function<void(const Key&, std::chrono::nanoseconds, const Agg&)>;
+
+private:
+    MqmWindow<Agg> window_;
+    const Emit emit_;
+    TimeOf timeOf_;
+    std::atomic<size_t> late_{ 0 };
+
+    void add(const Key& id, const Value* begin, const Value* end, MqmProcessingTime&)
+    {
+        auto emit = [&](std::chrono::nanoseconds start, const Agg& agg) { emit_(id, start, agg); };
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        for (auto v = begin; v != end; ++v)
+            window_.add(now, *v, emit);
+        window_.advance(now, emit);
+    }
+
+    template<typename F>
+    void add(const Key& id, const Value* begin, const Value* end, F& timeOf)
+    {
+        auto emit = [&](std::chrono::nanoseconds start, const Agg& agg) { emit_(id, start, agg); };
+        size_t late = 0;
+        for (auto v = begin; v != end; ++v)
+        {
+            auto time = std::chrono::duration_cast<std::chrono::nanoseconds>(timeOf(*v).time_since_epoch());
+            if (!window_.add(time, *v, emit))
+                ++late;
+        }
+        if (late)
+            late_.fetch_add(late, std::memory_order_relaxed);
+    }
+
+public:
+    MqmWindowConsumer(const MqmWindowSpec& spec, Emit emit, TimeOf timeOf = TimeOf())
+        : window_(spec)
+        , emit_(std::move(emit))
+        , timeOf_(std::move(timeOf)) { }
+
+    bool batched() const override { return true; }
+
+    std::chrono::milliseconds tick() const override
+    {
+        if (!std::is_same<TimeOf, MqmProcessingTime>::value)
+            return {};
+        auto slide = std::chrono::duration_cast<std::chrono::milliseconds>(window_.slide());
+        return std::max(slide / 4, std::chrono::milliseconds(1));
+    }
+
+    void consume(const Key& id, const Value& value) override
+    {
+        consumeBatch(id, &value, &value + 1);
+    }
+
+    void consumeBatch(const Key& id, const Value* begin, const Value* end) override
+    {
+        add(id, begin, end, timeOf_);
+    }
+
+    // event time values dropped behind the oldest open window
+    size_t late() const { return late_.load(std::memory_order_relaxed); }
+};
+
+// joins the streams of two keys on 'joinKeyOf(value)' within a time bound
+// (see MqmJoin): subscribed as one group, so the state is never touched
+// concurrently and needs no lock; the pairs (left, right) matched by one
+// batch go to 'emit' at once, in a buffer reused across batches
+template<typename Key, typename Value, typename JoinKeyOf, typename TimeOf = MqmProcessingTime>
+class MqmJoinConsumer : public MqmConsumer<Key, Value>
+{
+    using JoinKey = typename std::decay<decltype(std::declval<JoinKeyOf&>()(std::declval<const Value&>()))>::type;
+
+public:
+    using Pairs = std::vector<std::pair<Value, Value>>;
+    using Emit = std::function<void(const Pairs&)>;
+
+private:
+    const Key left_;
+    const Key right_;
+    MqmJoin<JoinKey, Value> join_;
+    JoinKeyOf joinKeyOf_;
+    TimeOf timeOf_;
+    const Emit emit_;
+    Pairs pairs_;
+
+public:
+    MqmJoinConsumer(const Key& left, const Key& right, std::chrono::milliseconds bound, size_t capacity,
+                    JoinKeyOf joinKeyOf, Emit emit, TimeOf timeOf = TimeOf())
+        : left_(left)
+        , right_(right)
+        , join_(bound, capacity)
+        , joinKeyOf_(std::move(joinKeyOf))
+        , timeOf_(std::move(timeOf))
+        , emit_(std::move(emit)) { }
+
+    bool batched() const override { return true; }
+
+    void consume(const Key& id, const Value& value) override
+    {
+        consumeBatch(id, &value, &value + 1);
+    }
+
+    void consumeBatch(const Key& id, const Value* begin, const Value* end) override
+    {
+        if (id != left_ && id != right_)
+            return;
+        bool right = id == right_;
+        auto match = [this](const Value& l, const Value& r) { pairs_.emplace_back(l, r); };
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        for (auto v = begin; v != end; ++v)
+            join_.add(right, joinKeyOf_(*v), mqmEventTime(timeOf_, *v, now), *v, match);
+        if (pairs_.empty())
+            return;
+        emit_(pairs_);
+        pairs_.clear();
+    }
+};
+
+// merges the streams of several keys into one time-ordered stream
+// (see MqmMerge): subscribed as one group, a batch is buffered and whatever
+// the watermark lets through goes to 'emit' at once, in a buffer reused across
+// batches; with 'idle' the drain also runs on ticks, so a silent key stops
+// holding the others back without new data
+template<typename Key, typename Value, typename TimeOf>
+class MqmMergeConsumer : public MqmConsumer<Key, Value>
+{
+public:
+    using Emit = std::function<void(const std::vector<Value>&)>;
+
+private:
+    std::map<Key, size_t> inputs_;
+    MqmMerge<Value> merge_;
+    const std::chrono::milliseconds idle_;
+    TimeOf timeOf_;
+    const Emit emit_;
+    std::vector<Value> out_;
+
+    static std::map<Key, size_t> index(const std::vector<Key>& keys)
+    {
+        std::map<Key, size_t> inputs;
+        for (auto& key : keys)
+            inputs.insert({ key, inputs.size() });
+        return inputs;
+    }
+
+public:
+    MqmMergeConsumer(const std::vector<Key>& keys, TimeOf timeOf, Emit emit,
+                     std::chrono::milliseconds idle = {})
+        : inputs_(index(keys))
+        , merge_(inputs_.size(), idle)
+        , idle_(idle)
+        , timeOf_(std::move(timeOf))
+        , emit_(std::move(emit)) { }
+
+    bool batched() const override { return true; }
+
+    std::chrono::milliseconds tick() const override
+    {
+        return idle_.count() ? std::max(idle_ / 2, std::chrono::milliseconds(1)) : idle_;
+    }
+
+    void consume(const Key& id, const Value& value) override
+    {
+        consumeBatch(id, &value, &value + 1);
+    }
+
+    void consumeBatch(const Key& id, const Value* begin, const Value* end) override
+    {
+        auto i = inputs_.find(id);
+        if (i == inputs_.end())
+            return;
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        for (auto v = begin; v != end; ++v)
+            merge_.push(i->second, mqmEventTime(timeOf_, *v, now), *v);
+
+        merge_.drain([this](Value&& v) { out_.emplace_back(std::move(v)); });
+        if (out_.empty())
+            return;
+        emit_(out_);
+        out_.clear();
+    }
+};
+
+// values held back until their due time on the processor's timer,
+// released into their keys' sources as one batch per key and tick
+template<typename Key, typename Value>
+class MqmDelay : public std::enable_shared_from_this<MqmDelay<Key, Value>>
+{
+    using Clock = MqmTimer::Clock;
+    using Wheel = MqmTimingWheel<std::pair<Key, Value>>;
+    using Release = std::function<void(const Key&, std::vector<Value>&&)>;
+
+    const MqmTimerPtr timer_;
+    const Release release_;
+    const Clock::time_point start_ = Clock::now();
+    Wheel wheel_;
+    uint64_t armed_ = Wheel::Never;
+    std::mutex mtx_;
+
+    // held while releasing, close() waits for a release in flight
+    std::mutex releaseMtx_;
+    bool closed_ = false;
+
+    // under mtx_, an earlier timer entry may still fire, that's a no-op
+    void arm()
+    {
+        uint64_t next = wheel_.next();
+        if (next >= armed_)
+            return;
+        armed_ = next;
+        std::weak_ptr<MqmDelay> weak = this->shared_from_this();
+        timer_->at(start_ + MqmTimer::Tick(next), [weak]() {
+            if (auto self = weak.lock())
+                self->fire();
+        });
+    }
+
+    void fire()
+    {
+        std::unique_lock<std::mutex> release{ releaseMtx_ };
+        if (closed_)
+            return;
+
+        std::vector<std::pair<Key, Value>> due;
+        {
+            std::unique_lock<std::mutex> lock{ mtx_ };
+            armed_ = Wheel::Never;
+            wheel_.advance(std::chrono::duration_cast<MqmTimer::Tick>(Clock::now() - start_).count(), due);
+            arm();
+        }
+
+        std::map<Key, std::vector<Value>> batches;
+        for (auto& d : due)
+            batches[d.first].emplace_back(std::move(d.second));
+        for (auto& b : batches)
+            try
+            {
+                release_(b.first, std::move(b.second));
+            }
+            catch (const std::exception& e)
+            {
+                std::cout << "delayed release error: " << e.what() << "\n";
+            }
+    }
+
+public:
+    MqmDelay(const MqmTimerPtr& timer, Release release)
+        : timer_(timer)
+        , release_(std::move(release)) { }
+
+    // O(1), rounded up to the next millisecond
+    void add(const Key& key, Clock::time_point when, Value&& value)
+    {
+        uint64_t due = 0;
+        if (when > start_)
+        {
+            auto ticks = std::chrono::duration_cast<MqmTimer::Tick>(when - start_);
+            due = ticks.count() + (start_ + ticks < when ? 1 : 0);
+        }
+
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        wheel_.add(due, std::make_pair(key, std::move(value)));
+        arm();
+    }
+
+    // pending values are dropped
+    void close()
+    {
+        std::unique_lock<std::mutex> release{ releaseMtx_ };
+        closed_ = true;
+    }
+};
+
+template<typename Key, typename Value>
+using MqmDelayPtr = std::shared_ptr<MqmDelay<Key, Value>>;
+
+// sources collection + sinks collection 
+template<typename Key, typename Value>
+using MqmActiveSinkPtr = std::shared_ptr<MqmActiveSink<Key, Value>>;
+
+template<typename Key, typename Value>
+class MqmProcessor
+{
+    const MqmThreadPoolPtr pool_;
+    MqmThreadPoolPtr blockingPool_;
+    MqmThreadPoolPtr quarantinePool_;
+    MqmTimerPtr timer_;
+    const size_t chunk_ = 0;
+
+    std::map<Key, MqmSourcePtr<Value>> sources_;
+    std::mutex sourcesMtx_;
+
+    std::map<Key, MqmActiveSinkPtr<Key, Value>> sinks_;
+    std::mutex sinksMtx_;
+
+    // set by the destructor, enqueue() is refused from then on
+    std::atomic<bool> closed_{ false };
+
+    // MqmLimitMode::Pace buckets, kept for sinks subscribed later
+    std::map<Key, MqmTokenBucketPtr> paces_;
+
+    // unsubscribed keys, see MqmOrphanPolicy (under sourcesMtx_)
+    MqmOrphanPolicy orphanPolicy_ = MqmOrphanPolicy::Buffer;
+    size_t orphanLimit_ = 0;
+    std::function<void(const Key&, std::vector<Value>&&)> orphanHandler_;
+    std::atomic<size_t> orphaned_{ 0 };
+
+    // subscribe_all() directories: sorted keys subscribed for real
+    // on their first value; the list is copied on write under deferredMtx_
+    // and published, so an enqueue reads it without a lock (replaced copies
+    // are only pointers, kept until the processor goes)
+    enum class DeferredState : unsigned char
+    {
+        Pending,
+        Activated,
+        Dropped  // subscribed or unsubscribed directly since
+    };
+    struct Deferred
+    {
+        std::vector<Key> keys;
+        std::unique_ptr<std::atomic<DeferredState>[]> states;
+        MqmConsumerPtr<Key, Value> consumer;
+    };
+    using DeferredList = std::vector<std::shared_ptr<Deferred>>;
+    MqmPublished<DeferredList> deferred_;
+    std::mutex deferredMtx_;
+    std::mutex activateMtx_;
+    std::atomic<bool> hasDeferred_{ false };
+
+    // last-value cache slots, kept across unsubscribe() for later subscribers;
+    // copied on write under sinksMtx_ and published, so latest() and cached()
+    // look a key up without a lock (each cache() of a new key keeps a copy
+    // of the slots until the processor goes, they are meant for a few keys)
+    using LatestMap = std::map<Key, MqmLatestPtr<Value>>;
+    MqmPublished<LatestMap> latest_;
+
+    // tenants of the keys, kept for sinks subscribed later
+    MqmFairSchedulerPtr fair_;
+    MqmFairCost fairCost_ = MqmFairCost::Time;
+    std::map<Key, size_t> tenants_;
+
+    // once any key has a latency budget, every pooled key is drained by deadline
+    MqmDeadlineSchedulerPtr edf_;
+    std::map<Key, std::chrono::microseconds> budgets_;
+
+    // stopped first, its handler may call back into the processor
+    MqmWatchdogPtr<Key> watchdog_;
+    MqmDelayPtr<Key, Value> delay_;
+
+    MqmSourcePtr<Value> getSource(const Key& key)
+    {
+        std::unique_lock<std::mutex> lock{ sourcesMtx_ };
+        return getSourceLocked(key);
+    }
+
+    MqmSourcePtr<Value> getSourceLocked(const Key& key)
+    {
+        auto ib = sources_.insert({key, nullptr});
+        if (ib.second)
+        {
+            ib.first->second = std::make_shared<MqmSource<Value>>();;
+            if (orphanLimit_)
+                ib.first->second->orphans(orphanLimit_);
+        }
+        return ib.first->second;
+    }
+
+    // the source to enqueue to, nullptr when nobody subscribed to the key and
+    // its values aren't buffered ('handler' is set for MqmOrphanPolicy::Route);
+    // one lookup under the sources lock, unless the key may be a
+    // subscribe_all() one still to be activated
+    MqmSourcePtr<Value> getSource(const Key& key,
+                                  std::function<void(const Key&, std::vector<Value>&&)>& handler)
+    {
+        bool deferred = hasDeferred_.load(std::memory_order_acquire);
+        {
+            std::unique_lock<std::mutex> lock{ sourcesMtx_ };
+            auto i = sources_.find(key);
+            if (i != sources_.end() && i->second->subscribed())
+                return i->second;
+            if (!deferred)
+                return getOrphanLocked(key, handler);
+        }
+        if (auto source = activate(key))
+            return source;
+        std::unique_lock<std::mutex> lock{ sourcesMtx_ };
+        return getOrphanLocked(key, handler);
+    }
+
+    // the source of an unsubscribed key, as its MqmOrphanPolicy says
+    MqmSourcePtr<Value> getOrphanLocked(const Key& key,
+                                        std::function<void(const Key&, std::vector<Value>&&)>& handler)
+    {
+        if (orphanPolicy_ == MqmOrphanPolicy::Buffer)
+            return getSourceLocked(key);
+        if (orphanPolicy_ == MqmOrphanPolicy::Route)
+            handler = orphanHandler_;
+        return nullptr;
+    }
+
+    // marks the key done in the subscribe_all() directories ('activated' - by
+    // its first value), returns the consumers it still was to be subscribed to
+    std::vector<MqmConsumerPtr<Key, Value>> claim(const Key& key, bool activated = false)
+    {
+        std::vector<MqmConsumerPtr<Key, Value>> consumers;
+        if (!hasDeferred_.load(std::memory_order_acquire))
+            return consumers;
+        std::unique_lock<std::mutex> lock{ deferredMtx_ };
+        for (auto& d : deferred_.get())
+        {
+            auto i = std::lower_bound(d->keys.begin(), d->keys.end(), key);
+            if (i == d->keys.end() || key < *i)
+                continue;
+            auto& state = d->states[i - d->keys.begin()];
+            if (state.load(std::memory_order_relaxed) == DeferredState::Pending)
+                consumers.push_back(d->consumer);
+            if (!activated)
+                state.store(DeferredState::Dropped, std::memory_order_release);
+            else if (state.load(std::memory_order_relaxed) == DeferredState::Pending)
+                state.store(DeferredState::Activated, std::memory_order_release);
+        }
+        return consumers;
+    }
+
+    // without a lock: the key is in a subscribe_all() directory and wasn't
+    // subscribed or unsubscribed directly since
+    bool deferred(const Key& key)
+    {
+        for (auto& d : deferred_.get())
+        {
+            auto i = std::lower_bound(d->keys.begin(), d->keys.end(), key);
+            if (i != d->keys.end() && !(key < *i) &&
+                d->states[i - d->keys.begin()].load(std::memory_order_acquire) != DeferredState::Dropped)
+                return true;
+        }
+        return false;
+    }
+
+    // subscribes a subscribe_all() key on its first value, nullptr if it
+    // isn't one or was unsubscribed since; racing producers wait for it,
+    // other keys' values don't take the lock
+    MqmSourcePtr<Value> activate(const Key& key)
+    {
+        if (!deferred(key))
+            return nullptr;
+        std::unique_lock<std::mutex> lock{ activateMtx_ };
+        for (auto& consumer : claim(key, true))
+            subscribe(key, consumer, MqmDelivery::Broadcast, nullptr);
+
+        std::unique_lock<std::mutex> sourcesLock{ sourcesMtx_ };
+        auto i = sources_.find(key);
+        return i != sources_.end() && i->second->subscribed() ? i->second : nullptr;
+    }
+
+    void orphan(const Key& key, std::vector<Value>&& values,
+                const std::function<void(const Key&, std::vector<Value>&&)>& handler)
+    {
+        if (!handler)
+        {
+            orphaned_ += values.size();
+            return;
+        }
+        try
+        {
+            handler(key, std::move(values));
+        }
+        catch (const std::exception& e)
+        {
+            std::cout << "orphan handler error: " << e.what() << "\n";
+        }
+    }
+
+    void removeSource(const Key& key)
+    {
+        std::unique_lock<std::mutex> lock{ sourcesMtx_ };
+        auto i = sources_.find(key);
+        if (i == sources_.end())
+            return;
+        i->second->stop();
+        sources_.erase(i);
+    }
+
+    MqmActiveSinkPtr<Key, Value> getSink(const Key& key, MqmDelivery delivery, bool& created)
+    {
+        std::unique_lock<std::mutex> lock{ sinksMtx_ };
+        auto ib = sinks_.insert({ key, nullptr });
+        created = ib.second;
+        if (ib.second)
+        {
+            ib.first->second = std::make_shared<MqmActiveSink<Key, Value>>(key, delivery, pool_, chunk_);
+            if (watchdog_)
+                ib.first->second->watch(watchdog_);
+            auto pace = paces_.find(key);
+            if (pace != paces_.end())
+                ib.first->second->pace(pace->second);
+            auto latest = latest_.get().find(key);
+            if (latest != latest_.get().end())
+                ib.first->second->latest(latest->second);
+            auto tenant = tenants_.find(key);
+            if (tenant != tenants_.end())
+                ib.first->second->fair(fair_, tenant->second);
+            if (edf_)
+                ib.first->second->deadline(edf_, budgets_.count(key) ? budgets_[key] : std::chrono::microseconds());
+        }
+        else if (ib.first->second->delivery() != delivery)
+            throw std::runtime_error("Can't subscribe, key has another delivery mode");
+        return ib.first->second;
+    }
+
+    // all or nothing, a key that already runs on its own task can't join a group
+    std::vector<MqmActiveSinkPtr<Key, Value>> getSinks(const std::vector<Key>& keys,
+                                                       const MqmActiveGroupPtr<Key, Value>& group)
+    {
+        std::unique_lock<std::mutex> lock{ sinksMtx_ };
+        for (auto& key : keys)
+            if (sinks_.count(key))
+                throw std::runtime_error("Can't subscribe group, key is already subscribed");
+
+        std::vector<MqmActiveSinkPtr<Key, Value>> sinks;
+        sinks.reserve(keys.size());
+        for (auto& key : keys)
+        {
+            sinks.push_back(std::make_shared<MqmActiveSink<Key, Value>>(
+                key, MqmDelivery::Broadcast, pool_, chunk_, group));
+            sinks_[key] = sinks.back();
+            if (watchdog_)
+                sinks.back()->watch(watchdog_);
+            auto pace = paces_.find(key);
+            if (pace != paces_.end())
+                sinks.back()->pace(pace->second);
+            auto latest = latest_.get().find(key);
+            if (latest != latest_.get().end())
+                sinks.back()->latest(latest->second);
+            auto tenant = tenants_.find(key);
+            if (tenant != tenants_.end())
+                sinks.back()->fair(fair_, tenant->second);
+            if (edf_)
+                sinks.back()->deadline(edf_, budgets_.count(key) ? budgets_[key] : std::chrono::microseconds());
+        }
+        return sinks;
+    }
+
+    // elastic, created on the first blocking consumer unless given
+    MqmThreadPoolPtr getBlockingPool(const MqmConsumerPtr<Key, Value>& consumer)
+    {
+        if (!pool_ || !consumer->blocking())
+            return nullptr;
+
+        std::unique_lock<std::mutex> lock{ sinksMtx_ };
+        if (!blockingPool_)
+        {
+            MqmPoolLimits limits;
+            limits.maxThreads = BlockingThreads;
+            blockingPool_ = std::make_shared<MqmThreadPool>(limits);
+        }
+        return blockingPool_;
+    }
+
+    MqmTimerPtr getTimer()
+    {
+        std::unique_lock<std::mutex> lock{ sinksMtx_ };
+        if (!timer_)
+            timer_ = std::make_shared<MqmTimer>();
+        return timer_;
+    }
+
+    // a cached key with a value already delivered
+    bool cached(const Key& key)
+    {
+        auto& latest = latest_.get();
+        auto i = latest.find(key);
+        return i != latest.end() && !i->second->empty();
+    }
+
+    void subscribe(const Key& key, const MqmConsumerPtr<Key, Value>& consumer,
+                   MqmDelivery delivery, const MqmRecoveryPtr<Key, Value>& recovery)
+    {
+        bool created{};
+        auto sink = getSink(key, delivery, created);
+        auto source = getSource(key);
+        if (created && delivery == MqmDelivery::Compete)
+            try
+            {
+                source->share(SharedCapacity, SharedQuantum);
+            }
+            catch (...)
+            {
+                removeSink(key);
+                throw;
+            }
+        bool snapshot = delivery == MqmDelivery::Broadcast && cached(key);
+        sink->subscribe(consumer, getBlockingPool(consumer), recovery, snapshot);
+        source->subscribe();
+        tick(source, consumer);
+        if (created)
+            sink->start(source);
+        if (snapshot)
+            source->poke();
+        for (auto& c : claim(key))
+            subscribe(key, c, MqmDelivery::Broadcast, nullptr);
+    }
+
+    MqmDelayPtr<Key, Value> getDelay()
+    {
+        auto timer = getTimer();
+        std::unique_lock<std::mutex> lock{ sinksMtx_ };
+        if (!delay_)
+            delay_ = std::make_shared<MqmDelay<Key, Value>>(timer,
+                [this](const Key& key, std::vector<Value>&& values) {
+                    enqueue_nowait(key, std::move(values));
+                });
+        return delay_;
+    }
+
+    // re-armed from the timer thread until the source is gone
+    static void pokeEvery(MqmTimer* timer, const MqmSourceWeak<Value>& source,
+                          std::chrono::milliseconds period)
+    {
+        timer->schedule(period, [timer, source, period]() {
+            auto s = source.lock();
+            if (!s)
+                return;
+            s->poke();
+            pokeEvery(timer, source, period);
+        });
+    }
+
+    void tick(const MqmSourcePtr<Value>& source, const MqmConsumerPtr<Key, Value>& consumer)
+    {
+        if (consumer->tick().count())
+            pokeEvery(getTimer().get(), source, consumer->tick());
+    }
+
+    void removeSink(const Key& key)
+    {
+        std::unique_lock<std::mutex> lock{ sinksMtx_ };
+        sinks_.erase(key);
+    }
+
+public:
+    static constexpr size_t SharedCapacity = 1 << 16;
+    static constexpr size_t SharedQuantum = 64;
+    static constexpr size_t ParallelChunk = 4096;
+    static constexpr size_t BlockingThreads = 64;
+
+    MqmProcessor() = default;
+
+    // 'pool' runs the drain tasks, and the chunks of large batches
+    // for order-insensitive consumers (batches of at least two 'chunk's are split)
+    explicit MqmProcessor(const MqmThreadPoolPtr& pool, size_t chunk = ParallelChunk)
+        : pool_(pool)
+        , chunk_(chunk) { }
+
+    // keys with a blocking consumer are drained on 'blockingPool'
+    MqmProcessor(const MqmThreadPoolPtr& pool, const MqmThreadPoolPtr& blockingPool,
+                 size_t chunk = ParallelChunk)
+        : pool_(pool)
+        , blockingPool_(blockingPool)
+        , chunk_(chunk) { }
+
+    // the drains still consume the pending values and may enqueue (dead
+    // letters, windows, pipelines), so every one is joined before any other
+    // member goes; their enqueues are refused
+    ~MqmProcessor()
+    {
+        closed_.store(true, std::memory_order_release);
+        watchdog_.reset();
+        if (delay_)
+            delay_->close();
+        {
+            std::unique_lock<std::mutex> lock{ sourcesMtx_ };
+            for (auto& s : sources_)
+                s.second->stop();
+        }
+        std::map<Key, MqmActiveSinkPtr<Key, Value>> sinks;
+        {
+            std::unique_lock<std::mutex> lock{ sinksMtx_ };
+            sinks.swap(sinks_);
+        }
+        sinks.clear();
+    }
+
+    // MqmDelivery::Compete turns the key into a work queue: its consumers
+    // drain one shared MPMC ring concurrently, so ordering is not kept
+    void subscribe(const Key& key, const MqmConsumerPtr<Key, Value>& consumer,
+                   MqmDelivery delivery = MqmDelivery::Broadcast)
+    {
+        subscribe(key, consumer, delivery, nullptr);
+    }
+
+    // values the consumer throws on are retried per 'retry' (timed retries
+    // come back through the key's drain, so the consumer is never called
+    // concurrently) and routed to the dead letter key once given up
+    void subscribe(const Key& key, const MqmConsumerPtr<Key, Value>& consumer,
+                   const MqmRetry<Key>& retry, MqmDelivery delivery = MqmDelivery::Broadcast)
+    {
+        auto recovery = std::make_shared<MqmRecovery<Key, Value>>();
+        recovery->retry = retry;
+        if (retry.attempts && retry.backoff.count())
+            recovery->timer = getTimer();
+        recovery->enqueue = [this](const Key& key, std::vector<Value>&& values) {
+            enqueue(key, std::move(values));
+        };
+        subscribe(key, consumer, delivery, recovery);
+    }
+
+    // binds the keys to one execution context, later subscribe() calls
+    // for any of them stay on it
+    void subscribe(const std::vector<Key>& keys, const MqmConsumerPtr<Key, Value>& consumer)
+    {
+        std::vector<Key> unique = keys;
+        std::sort(unique.begin(), unique.end());
+        unique.erase(std::unique(unique.begin(), unique.end()), unique.end());
+
+        auto group = std::make_shared<MqmActiveGroup<Key, Value>>(pool_);
+        auto sinks = getSinks(unique, group);
+        std::vector<MqmSourcePtr<Value>> snapshots;
+        for (size_t i = 0; i < unique.size(); ++i)
+        {
+            auto source = getSource(unique[i]);
+            source->subscribe();
+            bool snapshot = cached(unique[i]);
+            sinks[i]->subscribe(consumer, getBlockingPool(consumer), nullptr, snapshot);
+            sinks[i]->start(source);
+            tick(source, consumer);
+            if (snapshot)
+                snapshots.push_back(source);
+        }
+        group->start();
+        for (auto& source : snapshots)
+            source->poke();
+        for (auto& key : unique)
+            for (auto& c : claim(key))
+                subscribe(key, c, MqmDelivery::Broadcast, nullptr);
+    }
+
+    // subscribe() for a large set of keys at once (MqmDelivery::Broadcast):
+    // the keys are only sorted into a directory here, a key gets its source,
+    // sink and drain task on its first value, so idle keys cost a few bytes
+    // (keys already subscribed, or with values buffered, are subscribed right away)
+    template<typename Range>
+    void subscribe_all(const Range& keys, const MqmConsumerPtr<Key, Value>& consumer)
+    {
+        auto d = std::make_shared<Deferred>();
+        d->keys.assign(std::begin(keys), std::end(keys));
+        std::sort(d->keys.begin(), d->keys.end());
+        d->keys.erase(std::unique(d->keys.begin(), d->keys.end(),
+                                  [](const Key& a, const Key& b) { return !(a < b) && !(b < a); }),
+                      d->keys.end());
+        d->keys.shrink_to_fit();
+        d->states.reset(new std::atomic<DeferredState>[d->keys.size()]);
+        for (size_t i = 0; i < d->keys.size(); ++i)
+            d->states[i].store(DeferredState::Pending, std::memory_order_relaxed);
+        d->consumer = consumer;
+
+        std::vector<Key> buffered;
+        {
+            std::unique_lock<std::mutex> lock{ sourcesMtx_ };
+            for (auto& s : sources_)
+                if (std::binary_search(d->keys.begin(), d->keys.end(), s.first))
+                    buffered.push_back(s.first);
+        }
+        {
+            std::unique_lock<std::mutex> lock{ deferredMtx_ };
+            DeferredList deferred = deferred_.get();
+            deferred.push_back(std::move(d));
+            deferred_.publish(std::move(deferred));
+            hasDeferred_.store(true, std::memory_order_release);
+        }
+        for (auto& key : buffered)
+            activate(key);
+    }
+
+    // reports consumers busy with one batch for longer than 'budget';
+    // with 'quarantine' (pooled processors) a stuck key's later batches
+    // run there, so it can't take more workers from the healthy keys
+    void watch(std::chrono::milliseconds budget,
+               std::function<void(const Key&, std::chrono::milliseconds)> onStuck,
+               const MqmThreadPoolPtr& quarantine = nullptr)
+    {
+        auto watchdog = std::make_shared<MqmWatchdog<Key>>(budget,
+            [this, onStuck](const Key& key, std::chrono::milliseconds stuckFor) {
+                this->quarantine(key);
+                if (onStuck)
+                    onStuck(key, stuckFor);
+            });
+
+        std::unique_lock<std::mutex> lock{ sinksMtx_ };
+        if (watchdog_)
+            throw std::runtime_error("Can't watch, watchdog is already set");
+        quarantinePool_ = quarantine;
+        watchdog_ = watchdog;
+        for (auto& s : sinks_)
+            s.second->watch(watchdog_);
+    }
+
+    // moves the key's context (its whole group) onto the quarantine pool
+    void quarantine(const Key& key)
+    {
+        std::unique_lock<std::mutex> lock{ sinksMtx_ };
+        auto i = sinks_.find(key);
+        if (i != sinks_.end() && quarantinePool_)
+            i->second->rebind(quarantinePool_);
+    }
+
+    // aggregates of the key's windows are enqueued to 'downstream'
+    // (Value constructible from Agg), see MqmWindowConsumer
+    template<typename Agg, typename TimeOf = MqmProcessingTime>
+    void window(const Key& key, const MqmWindowSpec& spec, const Key& downstream,
+                TimeOf timeOf = TimeOf())
+    {
+        subscribe(key, std::make_shared<MqmWindowConsumer<Key, Value, Agg, TimeOf>>(spec,
+            [this, downstream](const Key&, std::chrono::nanoseconds, const Agg& agg) {
+                enqueue(downstream, Value(agg));
+            }, std::move(timeOf)));
+    }
+
+    // joins the streams of 'left' and 'right' (subscribed as one group),
+    // see MqmJoinConsumer; more throughput takes several key pairs, e.g.
+    // repartitioned by join key, each joined on its own context
+    template<typename JoinKeyOf, typename TimeOf = MqmProcessingTime>
+    void join(const Key& left, const Key& right, std::chrono::milliseconds bound, size_t capacity,
+              JoinKeyOf joinKeyOf, typename MqmJoinConsumer<Key, Value, JoinKeyOf, TimeOf>::Emit emit,
+              TimeOf timeOf = TimeOf())
+    {
+        subscribe(std::vector<Key>{ left, right }, std::make_shared<MqmJoinConsumer<Key, Value, JoinKeyOf, TimeOf>>(
+            left, right, bound, capacity, std::move(joinKeyOf), std::move(emit), std::move(timeOf)));
+    }
+
+    // merges the streams of 'keys' (subscribed as one group) in 'timeOf(value)'
+    // order, see MqmMergeConsumer
+    template<typename TimeOf>
+    void merge(const std::vector<Key>& keys, TimeOf timeOf,
+               typename MqmMergeConsumer<Key, Value, TimeOf>::Emit emit,
+               std::chrono::milliseconds idle = {})
+    {
+        subscribe(keys, std::make_shared<MqmMergeConsumer<Key, Value, TimeOf>>(
+            keys, std::move(timeOf), std::move(emit), idle));
+    }
+
+    // token bucket limit of 'rate' values per second, up to 'burst' at once,
+    // shared by all 'keys' (a tenant's keys ...); enforced at enqueue or drain,
+    // see MqmLimitMode
+    void limit(const std::vector<Key>& keys, double rate, size_t burst,
+               MqmLimitMode mode = MqmLimitMode::Delay)
+    {
+        auto bucket = std::make_shared<MqmTokenBucket>(rate, burst);
+        if (mode != MqmLimitMode::Pace)
+        {
+            for (auto& key : keys)
+                getSource(key)->limit(bucket, mode == MqmLimitMode::Reject);
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock{ sinksMtx_ };
+        for (auto& key : keys)
+        {
+            paces_[key] = bucket;
+            auto i = sinks_.find(key);
+            if (i != sinks_.end())
+                i->second->pace(bucket);
+        }
+    }
+
+    void limit(const Key& key, double rate, size_t burst, MqmLimitMode mode = MqmLimitMode::Delay)
+    {
+        limit(std::vector<Key>{ key }, rate, burst, mode);
+    }
+
+    // what tenants' shares are measured in, before the first tenant()
+    void fairness(MqmFairCost cost)
+    {
+        std::unique_lock<std::mutex> lock{ sinksMtx_ };
+        if (fair_)
+            throw std::runtime_error("Can't change fairness, tenants are already set");
+        fairCost_ = cost;
+    }
+
+    // pooled processors: the keys' drains share the pool with other tenants
+    // in proportion to 'weight' (deficit round robin, see MqmFairScheduler),
+    // however many keys each tenant has; keys moved to the blocking or
+    // quarantine pool leave it
+    void tenant(size_t tenant, const std::vector<Key>& keys, double weight = 1)
+    {
+        std::unique_lock<std::mutex> lock{ sinksMtx_ };
+        if (!pool_)
+            return;
+        if (edf_)
+            throw std::runtime_error("Can't set tenant, keys are drained by deadline");
+        if (!fair_)
+            fair_ = std::make_shared<MqmFairScheduler>(pool_, fairCost_);
+        fair_->weigh(tenant, weight);
+        for (auto& key : keys)
+        {
+            tenants_[key] = tenant;
+            auto i = sinks_.find(key);
+            if (i != sinks_.end())
+                i->second->fair(fair_, tenant);
+        }
+    }
+
+    // pooled processors: ready keys are drained earliest deadline first,
+    // the deadline being the enqueue time of the oldest pending value + 'budget'
+    // (see MqmDeadlineScheduler); keys without a budget fill the gaps;
+    // not combined with tenants
+    void budget(const Key& key, std::chrono::microseconds budget)
+    {
+        std::unique_lock<std::mutex> lock{ sinksMtx_ };
+        if (!pool_)
+            return;
+        if (fair_)
+            throw std::runtime_error("Can't set budget, keys are drained by tenant");
+        budgets_[key] = budget;
+        if (!edf_)
+        {
+            edf_ = std::make_shared<MqmDeadlineScheduler>(pool_);
+            for (auto& s : sinks_)
+                s.second->deadline(edf_, budgets_.count(s.first) ? budgets_[s.first] : std::chrono::microseconds());
+            return;
+        }
+        auto i = sinks_.find(key);
+        if (i != sinks_.end())
+            i->second->deadline(edf_, budget);
+    }
+
+    // load shedding of the key's backlog, see MqmShedding
+    void shed(const Key& key, const MqmShedding<Value>& shedding)
+    {
+        getSource(key)->shed(shedding);
+    }
+
+    // backlog of the key over 'limit' values goes to disk, see MqmSource::spill()
+    void spill(const Key& key, const std::string& directory, size_t limit)
+    {
+        getSource(key)->spill(directory, limit);
+    }
+
+    // values of the key dropped by shedding so far
+    size_t dropped(const Key& key)
+    {
+        return getSource(key)->dropped();
+    }
+
+    // for keys nobody subscribed to: MqmOrphanPolicy::Buffer keeps the newest
+    // 'limit' values per key (zero - all; trimmed once 1/16 over, counted
+    // in dropped()), Drop counts them in orphaned(),
+    // Route calls 'handler' on the enqueuing thread; keys are subscribed
+    // once subscribe() is called, unsubscribe() makes them orphans again
+    void orphans(MqmOrphanPolicy policy, size_t limit = 0,
+                 std::function<void(const Key&, std::vector<Value>&&)> handler = nullptr)
+    {
+        if (policy == MqmOrphanPolicy::Route && !handler)
+            throw std::runtime_error("Can't route orphans, handler is not set");
+
+        std::unique_lock<std::mutex> lock{ sourcesMtx_ };
+        orphanPolicy_ = policy;
+        orphanLimit_ = policy == MqmOrphanPolicy::Buffer ? limit : 0;
+        orphanHandler_ = handler;
+        for (auto& s : sources_)
+            s.second->orphans(orphanLimit_);
+    }
+
+    // moves the pending values of every key into one file at 'path' for
+    // restore() by the next process: written sequentially, encoded with
+    // MqmCodec straight into the write buffer (spilled values are copied
+    // as stored); values held by enqueue_at() or being consumed right now
+    // aren't included; if it throws, the values stay queued;
+    // returns the number of values
+    size_t snapshot(const std::string& path)
+    {
+        std::vector<std::pair<Key, MqmSourcePtr<Value>>> sources;
+        {
+            std::unique_lock<std::mutex> lock{ sourcesMtx_ };
+            sources.assign(sources_.begin(), sources_.end());
+        }
+
+        // the values are gone from the sources only once the file is in
+        // place, a failed snapshot puts them back
+        std::vector<typename MqmSource<Value>::Pending> taken;
+        taken.reserve(sources.size());
+        size_t total = 0;
+        try
+        {
+            MqmSnapshotWriter out(path);
+            for (auto& s : sources)
+            {
+                taken.push_back(s.second->takeAll());
+                auto& pending = taken.back();
+                size_t count = pending.size();
+                if (!count)
+                    continue;
+                MqmCodec<Key>::write(s.first, out.begin());
+                out.end();
+                out.count(count);
+                for (auto& v : pending.values)
+                {
+                    MqmCodec<Value>::write(v, out.begin());
+                    out.end();
+                }
+                if (pending.spill)
+                    pending.spill->read([&out](const char* data, size_t size) { out.record(data, size); });
+                total += count;
+            }
+            out.close();
+        }
+        catch (...)
+        {
+            for (size_t i = 0; i < taken.size(); ++i)
+                try
+                {
+                    sources[i].second->putBack(std::move(taken[i]));
+                }
+                catch (const std::exception& e)
+                {
+                    std::cout << "snapshot error: " << e.what() << "\n";
+                }
+            throw;
+        }
+        return total;
+    }
+
+    // enqueues the values of a snapshot() file key by key, in their order,
+    // decoded straight from the file's read-only mapping; subscribe (or set
+    // the orphan policy) first; returns the number of values
+    size_t restore(const std::string& path)
+    {
+        MqmSnapshotReader in(path);
+        const char* data = nullptr;
+        size_t size = 0;
+        size_t total = 0;
+        while (in.record(data, size))
+        {
+            Key key = MqmCodec<Key>::read(data, size);
+            uint64_t count = in.count();
+            std::vector<Value> values;
+            values.reserve(static_cast<size_t>(count));
+            for (uint64_t i = 0; i < count; ++i)
+            {
+                if (!in.record(data, size))
+                    throw std::runtime_error("Can't restore, snapshot is truncated");
+                values.push_back(MqmCodec<Value>::read(data, size));
+            }
+            total += values.size();
+            enqueue(key, std::move(values));
+        }
+        return total;
+    }
+
+    // values of unsubscribed keys dropped by MqmOrphanPolicy::Drop so far
+    size_t orphaned() const { return orphaned_.load(std::memory_order_relaxed); }
+
+    // keeps the latest value delivered to the key's consumers, see MqmLatest;
+    // any thread reads it through the returned slot,
+    // and consumers subscribed later get it first, ahead of the key's
+    // next values, instead of waiting for one
+    MqmLatestPtr<Value> cache(const Key& key)
+    {
+        static_assert(std::is_copy_constructible<Value>::value, "Can't cache move-only values");
+        std::unique_lock<std::mutex> lock{ sinksMtx_ };
+        auto i = latest_.get().find(key);
+        if (i != latest_.get().end())
+            return i->second;
+        auto latest = std::make_shared<MqmLatest<Value>>();
+        LatestMap slots = latest_.get();
+        slots.emplace(key, latest);
+        latest_.publish(std::move(slots));
+        auto sink = sinks_.find(key);
+        if (sink != sinks_.end())
+            sink->second->latest(latest);
+        return latest;
+    }
+
+    // false - the key isn't cached or nothing was delivered yet;
+    // the slot is found without a lock in the published copy of the cached keys
+    bool latest(const Key& key, Value& value)
+    {
+        auto& latest = latest_.get();
+        auto i = latest.find(key);
+        return i != latest.end() && i->second->load(value);
+    }
+
+    // drops values of the key whose message id, 'idOf(value)' (anything
+    // std::hash takes), was seen within the last 'window' to 2 x 'window';
+    // 'capacity' - ids expected per window, memory is 2 x 18..34 bytes per id
+    // ('exact' false: 2 x 2 bytes, but up to ~1.5 in 1000 unique values
+    //  are dropped as false positives)
+    template<typename IdOf>
+    void dedup(const Key& key, IdOf idOf, std::chrono::milliseconds window,
+               size_t capacity = size_t(1) << 16, bool exact = true)
+    {
+        getSource(key)->dedup([idOf](const Value& v) { return mqmDedupHash(idOf(v)); },
+                              window, capacity, exact);
+    }
+
+    // values of the key dropped as duplicates so far
+    size_t duplicates(const Key& key)
+    {
+        return getSource(key)->duplicates();
+    }
+
+    // also for subscribe_all() keys, their next values don't bring them back
+    void unsubscribe(const Key& key)
+    {
+        claim(key);
+        removeSource(key);
+        removeSink(key);
+    }
+
+    // consumer-side batching for a key drained by its own thread, see MqmSource::linger
+    void linger(const Key& key, size_t minBatch, std::chrono::microseconds maxWait)
+    {
+        getSource(key)->linger(minBatch, maxWait);
+    }
+
+    // lets the key's drain task size its batches and linger on its own,
+    // holding the p99 of queue wait + consume time under 'target'
+    // (grouped and pooled keys get batch slicing only, linger needs a blocking drain;
+    //  overrides linger())
+    void adapt(const Key& key, std::chrono::microseconds target, size_t maxBatch = 4096)
+    {
+        getSource(key)->adapt(std::make_shared<MqmBatchController>(target, 1, maxBatch));
+    }
+
+    void enqueue(const Key& key, Value&& value)
+    {
+        if (closed_.load(std::memory_order_acquire))
+            throw std::runtime_error("Can't enqueue, processor is closed");
+        std::function<void(const Key&, std::vector<Value>&&)> handler;
+        if (auto source = getSource(key, handler))
+            return source->enqueue(std::move(value));
+        std::vector<Value> values;
+        values.emplace_back(std::move(value));
+        orphan(key, std::move(values), handler);
+    }
+
+    void enqueue(const Key& key, std::vector<Value>&& values)
+    {
+        if (closed_.load(std::memory_order_acquire))
+            throw std::runtime_error("Can't enqueue, processor is closed");
+        std::function<void(const Key&, std::vector<Value>&&)> handler;
+        if (auto source = getSource(key, handler))
+            return source->enqueue(std::move(values));
+        orphan(key, std::move(values), handler);
+    }
+
+    // enqueue() for callers that mustn't wait, as timer callbacks: values of
+    // a MqmLimitMode::Delay key that there are no tokens for yet are held on
+    // the timer (see enqueue_at()) until there are
+    void enqueue_nowait(const Key& key, std::vector<Value>&& values)
+    {
+        if (closed_.load(std::memory_order_acquire))
+            throw std::runtime_error("Can't enqueue, processor is closed");
+        std::function<void(const Key&, std::vector<Value>&&)> handler;
+        auto source = getSource(key, handler);
+        if (!source)
+            return orphan(key, std::move(values), handler);
+        auto wait = source->enqueueNow(values);
+        if (values.empty())
+            return;
+        auto delay = getDelay();
+        auto when = MqmTimer::Clock::now() + wait;
+        for (auto& v : values)
+            delay->add(key, when, std::move(v));
+    }
+
+    // held on the timer's wheel (1ms resolution) and released into the key's
+    // source together with the other values of that key due on the same tick;
+    // pending values are dropped with the processor
+    void enqueue_at(const Key& key, MqmTimer::Clock::time_point when, Value&& value)
+    {
+        getDelay()->add(key, when, std::move(value));
+    }
+
+    void enqueue_after(const Key& key, MqmTimer::Clock::duration delay, Value&& value)
+    {
+        enqueue_at(key, MqmTimer::Clock::now() + delay, std::move(value));
+    }
+
+    // the timer of delayed values and retries, started on first use
+    MqmTimerPtr timer()
+    {
+        return getTimer();
+    }
+};
+
+// producer-side buffer, one per producer thread (on its stack or thread_local),
+// hands values over per key in one batch once 'maxItems' are gathered,
+// or once the oldest buffered value is older than 'maxDelay';
+// the delay is checked on enqueue, and with 'timed' also on the processor's
+// timer, so an idle producer's values still go out in time (the buffer
+// then takes a lock, mostly uncontended, and the timer thread may flush)
+template<typename Key, typename Value>
+class MqmProducer
+{
+    using Clock = std::chrono::steady_clock;
+
+    // shared with the timer callbacks, which outlive the producer
+    struct Buffer
+    {
+        std::mutex mtx;
+        std::map<Key, std::vector<Value>> batches;
+        size_t pending = 0;
+        Clock::time_point oldest;
+        bool armed = false;
+    };
+
+    MqmProcessor<Key, Value>& processor_;
+    const size_t maxItems_;
+    const Clock::duration maxDelay_;
+    const std::shared_ptr<Buffer> buffer_ = std::make_shared<Buffer>();
+    const MqmTimerPtr timer_;
+
+    // 'nowait' on the timer thread, see MqmProcessor::enqueue_nowait()
+    static void flush(MqmProcessor<Key, Value>& processor, Buffer& buffer, bool nowait = false)
+    {
+        for (auto& b : buffer.batches)
+            if (!b.second.empty())
+            {
+                if (nowait)
+                    processor.enqueue_nowait(b.first, std::move(b.second));
+                else
+                    processor.enqueue(b.first, std::move(b.second));
+                b.second.clear();
+            }
+        buffer.pending = 0;
+    }
+
+    // re-armed until the buffer is flushed or gone
+    static void arm(MqmProcessor<Key, Value>* processor, MqmTimer* timer,
+                    const std::weak_ptr<Buffer>& bufferWeak, Clock::time_point when, Clock::duration maxDelay)
+    {
+        timer->at(when, [processor, timer, bufferWeak, maxDelay]() {
+            auto buffer = bufferWeak.lock();
+            if (!buffer)
+                return;
+            std::unique_lock<std::mutex> lock{ buffer->mtx };
+            buffer->armed = false;
+            if (!buffer->pending)
+                return;
+            if (Clock::now() - buffer->oldest < maxDelay)
+            {
+                buffer->armed = true;
+                return arm(processor, timer, bufferWeak, buffer->oldest + maxDelay, maxDelay);
+            }
+            try
+            {
+                flush(*processor, *buffer, true);
+            }
+            catch (const std::exception& e)
+            {
+                std::cout << "producer error: " << e.what() << "\n";
+            }
+        });
+    }
+
+public:
+    MqmProducer(MqmProcessor<Key, Value>& processor, size_t maxItems,
+                std::chrono::microseconds maxDelay, bool timed = false)
+        : processor_(processor)
+        , maxItems_(maxItems)
+        , maxDelay_(maxDelay)
+        , timer_(timed ? processor.timer() : nullptr) { }
+
+    ~MqmProducer()
+    {
+        try
+        {
+            flush();
+        }
+        catch (const std::exception& e)
+        {
+            std::cout << "producer error: " << e.what() << "\n";
+        }
+    }
+
+    MqmProducer(const MqmProducer&) = delete;
+    MqmProducer& operator=(const MqmProducer&) = delete;
+
+    void enqueue(const Key& key, Value&& value)
+    {
+        std::unique_lock<std::mutex> lock{ buffer_->mtx, std::defer_lock };
+        if (timer_)
+            lock.lock();
+
+        auto& buffer = *buffer_;
+        auto now = Clock::now();
+        if (!buffer.pending)
+            buffer.oldest = now;
+
+        auto& batch = buffer.batches[key];
+        batch.emplace_back(std::move(value));
+        ++buffer.pending;
+        if (batch.size() >= maxItems_)
+        {
+            buffer.pending -= batch.size();
+            processor_.enqueue(key, std::move(batch));
+            batch.clear();
+        }
+        if (buffer.pending && now - buffer.oldest >= maxDelay_)
+            flush(processor_, buffer);
+        if (timer_ && buffer.pending && !buffer.armed)
+        {
+            buffer.armed = true;
+            arm(&processor_, timer_.get(), buffer_, buffer.oldest + maxDelay_, maxDelay_);
+        }
+    }
+
+    void flush()
+    {
+        std::unique_lock<std::mutex> lock{ buffer_->mtx, std::defer_lock };
+        if (timer_)
+            lock.lock();
+        flush(processor_, *buffer_);
+    }
+};
+
+// stateless stages of a pipeline segment fused into one functor,
+// false - the value is filtered out
+struct MqmPass
+{
+    template<typename Value>
+    bool operator()(Value&) const { return true; }
+};
+
+template<typename Prev, typename F>
+struct MqmMapStage
+{
+    Prev prev;
+    F f;
+
+    template<typename Value>
+    bool operator()(Value& v)
+    {
+        if (!prev(v))
+            return false;
+        v = f(std::move(v));
+        return true;
+    }
+};
+
+template<typename Prev, typename F>
+struct MqmFilterStage
+{
+    Prev prev;
+    F f;
+
+    template<typename Value>
+    bool operator()(Value& v)
+    {
+        return prev(v) && f(static_cast<const Value&>(v));
+    }
+};
+
+// pipeline builder: source key -> map/filter/aggregate -> sink key or consumer;
+// adjacent map/filter stages and an aggregate are fused into the drain pass
+// of their key (one functor, no virtual call per value), a queue hop to other
+// keys is made only by repartition(), and batch-wise (one enqueue per key and batch);
+// nothing is subscribed until to() is called
+template<typename Key, typename Value, typename Chain = MqmPass>
+class MqmPipeline
+{
+public:
+    // the values a fused segment passes on, 'key' - the key it drains
+    using Feed = std::function<void(const Key&, const Value*, const Value*)>;
+    // one feed per drained key, windows keep per-key state
+    using FeedFactory = std::function<Feed()>;
+    // wires the stages before the current segment to its feeds,
+    // 'tick' - how often the drain has to run without data (processing time windows)
+    using Open = std::function<void(const FeedFactory&, std::chrono::milliseconds tick)>;
+
+private:
+    template<typename K, typename V, typename C>
+    friend class MqmPipeline;
+
+    class FeedConsumer : public MqmConsumer<Key, Value>
+    {
+        const Feed feed_;
+        const std::chrono::milliseconds tick_;
+
+    public:
+        FeedConsumer(Feed feed, std::chrono::milliseconds tick)
+            : feed_(std::move(feed))
+            , tick_(tick) { }
+
+        bool batched() const override { return true; }
+        std::chrono::milliseconds tick() const override { return tick_; }
+
+        void consume(const Key& id, const Value& value) override
+        {
+            feed_(id, &value, &value + 1);
+        }
+
+        void consumeBatch(const Key& id, const Value* begin, const Value* end) override
+        {
+            feed_(id, begin, end);
+        }
+    };
+
+    MqmProcessor<Key, Value>* processor_;
+    Open open_;
+    Chain chain_;
+
+    MqmPipeline(MqmProcessor<Key, Value>* processor, Open open, Chain chain)
+        : processor_(processor)
+        , open_(std::move(open))
+        , chain_(std::move(chain)) { }
+
+    static std::chrono::milliseconds sooner(std::chrono::milliseconds a, std::chrono::milliseconds b)
+    {
+        return !a.count() ? b : !b.count() ? a : std::min(a, b);
+    }
+
+    // the current segment's stages, then 'out'
+    static Feed fuse(Chain chain, std::function<void(const Key&, std::vector<Value>&&)> out)
+    {
+        return [chain, out](const Key& key, const Value* begin, const Value* end) mutable {
+            std::vector<Value> values;
+            values.reserve(end - begin);
+            for (auto v = begin; v != end; ++v)
+            {
+                Value x = *v;
+                if (chain(x))
+                    values.emplace_back(std::move(x));
+            }
+            out(key, std::move(values));
+        };
+    }
+
+    template<typename C>
+    MqmPipeline<Key, Value, C> next(Open open, C chain) const
+    {
+        return MqmPipeline<Key, Value, C>(processor_, std::move(open), std::move(chain));
+    }
+
+public:
+    MqmPipeline(MqmProcessor<Key, Value>& processor, const Key& source)
+        : processor_(&processor)
+        , open_([p = &processor, source](const FeedFactory& factory, std::chrono::milliseconds tick) {
+              p->subscribe(source, std::make_shared<FeedConsumer>(factory(), tick));
+          }) { }
+
+    // 'f(Value&&) -> Value'
+    template<typename F>
+    MqmPipeline<Key, Value, MqmMapStage<Chain, F>> map(F f) const
+    {
+        return next(open_, MqmMapStage<Chain, F>{ chain_, std::move(f) });
+    }
+
+    // 'f(const Value&) -> bool', false drops the value
+    template<typename F>
+    MqmPipeline<Key, Value, MqmFilterStage<Chain, F>> filter(F f) const
+    {
+        return next(open_, MqmFilterStage<Chain, F>{ chain_, std::move(f) });
+    }
+
+    // per-key windows (see MqmWindowConsumer) on the same drain pass,
+    // the aggregates go on as values (Value constructible from Agg)
+    template<typename Agg, typename TimeOf = MqmProcessingTime>
+    MqmPipeline<Key, Value, MqmPass> aggregate(const MqmWindowSpec& spec, TimeOf timeOf = TimeOf()) const
+    {
+        auto open = open_;
+        auto chain = chain_;
+        MqmWindow<Agg> probe(spec);
+        auto tick = std::is_same<TimeOf, MqmProcessingTime>::value
+            ? std::max(std::chrono::duration_cast<std::chrono::milliseconds>(probe.slide()) / 4,
+                       std::chrono::milliseconds(1))
+            : std::chrono::milliseconds();
+
+        return next([open, chain, spec, timeOf, tick](const FeedFactory& factory, std::chrono::milliseconds after) {
+            open([chain, spec, timeOf, factory]() -> Feed {
+                auto window = std::make_shared<MqmWindow<Agg>>(spec);
+                auto feed = factory();
+                return [chain, timeOf, window, feed](const Key& key, const Value* begin, const Value* end) mutable {
+                    std::vector<Value> values;
+                    auto emit = [&](std::chrono::nanoseconds, const Agg& agg) { values.emplace_back(agg); };
+                    auto now = std::chrono::steady_clock::now().time_since_epoch();
+                    for (auto v = begin; v != end; ++v)
+                    {
+                        Value x = *v;
+                        if (chain(x))
+                            window->add(mqmEventTime(timeOf, x, now), x, emit);
+                    }
+                    if (std::is_same<TimeOf, MqmProcessingTime>::value)
+                        window->advance(now, emit);
+                    feed(key, values.data(), values.data() + values.size());
+                };
+            }, sooner(tick, after));
+        }, MqmPass());
+    }
+
+    // queue hop: values move to the keys picked by 'keyOf(key, value)',
+    // drained by their own tasks; 'keys' - every key 'keyOf' may return
+    template<typename KeyOf>
+    MqmPipeline<Key, Value, MqmPass> repartition(const std::vector<Key>& keys, KeyOf keyOf) const
+    {
+        auto open = open_;
+        auto chain = chain_;
+        auto p = processor_;
+        return next([open, chain, p, keys, keyOf](const FeedFactory& factory, std::chrono::milliseconds tick) {
+            for (auto& key : keys)
+                p->subscribe(key, std::make_shared<FeedConsumer>(factory(), tick));
+            open([chain, p, keyOf]() {
+                return fuse(chain, [p, keyOf](const Key& key, std::vector<Value>&& values) mutable {
+                    std::map<Key, std::vector<Value>> batches;
+                    for (auto& v : values)
+                        batches[keyOf(key, static_cast<const Value&>(v))].emplace_back(std::move(v));
+                    for (auto& b : batches)
+                        p->enqueue(b.first, std::move(b.second));
+                });
+            }, {});
+        }, MqmPass());
+    }
+
+    // ends the pipeline in 'sink' of 'processor' (a queue hop), subscribes it
+    void to(MqmProcessor<Key, Value>& processor, const Key& sink) const
+    {
+        auto chain = chain_;
+        auto p = &processor;
+        open_([chain, p, sink]() {
+            return fuse(chain, [p, sink](const Key&, std::vector<Value>&& values) {
+                if (!values.empty())
+                    p->enqueue(sink, std::move(values));
+            });
+        }, {});
+    }
+
+    void to(const Key& sink) const
+    {
+        to(*processor_, sink);
+    }
+
+    // ends the pipeline in 'consumer', called on the last segment's drain
+    // with that segment's key
+    void to(const MqmConsumerPtr<Key, Value>& consumer) const
     {
-        getSource(key)->enqueue(std::move(value));
+        auto chain = chain_;
+        open_([chain, consumer]() {
+            return fuse(chain, [consumer](const Key& key, std::vector<Value>&& values) {
+                if (!values.empty())
+                    consumer->consumeBatch(key, values.data(), values.data() + values.size());
+            });
+        }, {});
     }
 };
 }
\ No newline at end of file
@@ -0,0 +1,50 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+
+namespace mqm
+{
+
+// AIMD feedback for one drain task: every consumed batch reports its
+// queue wait + consume time, the controller keeps the p99 of recent batches
+// under 'target' by halving batch size and linger when it is exceeded,
+// and growing them step by step while there is headroom
+// (not thread-safe, owned by a single drain task)
+class MqmBatchController
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr size_t Window = 128;
+    static constexpr size_t Period = 16;
+
+private:
+    const Clock::duration target_;
+    const size_t minBatch_;
+    const size_t maxBatch_;
+    const Clock::duration maxLinger_;
+
+    size_t batch_;
+    Clock::duration linger_{};
+
+    std::array<Clock::duration, Window> samples_{};
+    size_t count_ = 0;
+    Clock::duration p99_{};
+
+    void adjust();
+
+public:
+    MqmBatchController(std::chrono::microseconds target, size_t minBatch = 1, size_t maxBatch = 4096);
+
+    void record(Clock::duration wait, Clock::duration consume);
+
+    size_t batch() const { return batch_; }
+    std::chrono::microseconds linger() const;
+    Clock::duration p99() const { return p99_; }
+};
+
+using MqmBatchControllerPtr = std::shared_ptr<MqmBatchController>;
+
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "mqm/mqm_pool.h"
+
+namespace mqm
+{
+
+// earliest deadline first in front of a pool: drain tasks are queued with
+// a deadline, and every pool run takes the task due first; tasks without
+// a deadline (time_point::max()) fill the gaps in FIFO order, so under
+// sustained overload they wait for the deadline ones
+class MqmDeadlineScheduler : public std::enable_shared_from_this<MqmDeadlineScheduler>
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+private:
+    struct Ready
+    {
+        Clock::time_point deadline;
+        uint64_t seq;
+        std::function<void()> task;
+    };
+
+    const MqmThreadPoolPtr pool_;
+    std::vector<Ready> ready_;      // min-heap by deadline, then by seq
+    uint64_t seq_ = 0;
+    std::mutex mtx_;
+
+    void run();
+
+public:
+    explicit MqmDeadlineScheduler(const MqmThreadPoolPtr& pool);
+
+    MqmDeadlineScheduler(const MqmDeadlineScheduler&) = delete;
+    MqmDeadlineScheduler& operator=(const MqmDeadlineScheduler&) = delete;
+
+    void post(Clock::time_point deadline, std::function<void()> task);
+
+    // tasks waiting for a pool run
+    size_t depth();
+};
+
+using MqmDeadlineSchedulerPtr = std::shared_ptr<MqmDeadlineScheduler>;
+
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace mqm
+{
+
+// recently seen message ids of one key, in two generations that rotate every
+// 'window' (or when the current one holds 'capacity' ids), so an id is
+// remembered for one to two windows; each generation is a register-blocked
+// bloom filter (all bits of an id in one 64-bit word, a single cache miss)
+// of ~16 bits per id, and with 'exact' also an open-addressed table of the
+// 64-bit id hashes that a bloom positive is checked against, so a unique
+// message isn't dropped for a false positive; ids are hashed by the caller;
+// not thread-safe
+class MqmDedup
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+private:
+    struct Generation
+    {
+        std::vector<uint64_t> bits;
+        std::vector<uint64_t> ids;  // zero - empty slot
+        size_t count = 0;
+    };
+
+    const Clock::duration window_;
+    const size_t capacity_;
+    const bool exact_;
+    Generation generations_[2];
+    size_t current_ = 0;
+    Clock::time_point rotated_;
+
+    bool test(const Generation& g, uint64_t hash, uint64_t mask) const;
+    bool find(const Generation& g, uint64_t hash) const;
+    void insert(Generation& g, uint64_t hash, uint64_t mask);
+    void rotate(Clock::time_point now);
+
+public:
+    MqmDedup(Clock::duration window, size_t capacity, bool exact = true);
+
+    // true: 'hash' was seen within the window, otherwise it is remembered now
+    bool seen(uint64_t hash, Clock::time_point now = Clock::now());
+
+    // seen() in two steps, for a caller that remembers an id only once
+    // its message is let through
+    bool contains(uint64_t hash, Clock::time_point now = Clock::now());
+    void remember(uint64_t hash, Clock::time_point now = Clock::now());
+
+    size_t capacity() const { return capacity_; }
+};
+
+// hash of a user-extracted message id, spread over all 64 bits
+// (std::hash of an integer is often the identity)
+template<typename Id>
+uint64_t mqmDedupHash(const Id& id)
+{
+    uint64_t x = static_cast<uint64_t>(std::hash<Id>()(id)) + 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "mqm/mqm_pool.h"
+
+namespace mqm
+{
+
+// what a tenant's share of the pool is measured in
+enum class MqmFairCost
+{
+    Time,       // drain task run time
+    Messages    // values handed to consumers (see charge())
+};
+
+// deficit round robin over tenants in front of a pool: drain tasks are queued
+// per tenant, and every pool run picks the tenant whose turn it is; a turn
+// adds 'quantum' x weight to the tenant's deficit and lasts while the deficit
+// is positive, each task is charged its cost once it is done (a task may
+// overdraw, the debt is carried into the next turn); within a tenant the
+// ready tasks (one per key context) run in FIFO, i.e. round robin over keys
+class MqmFairScheduler : public std::enable_shared_from_this<MqmFairScheduler>
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Tenant
+    {
+        double weight = 1;
+        double deficit = 0;
+        bool active = false;
+        std::deque<std::function<void()>> ready;
+    };
+
+    const MqmThreadPoolPtr pool_;
+    const MqmFairCost cost_;
+    const double quantum_;
+    std::map<size_t, Tenant> tenants_;
+    std::deque<size_t> active_;     // tenants with ready tasks, the front has the turn
+    std::mutex mtx_;
+
+    void run();
+
+public:
+    // 'quantum' - per turn and unit of weight, nanoseconds or messages
+    // (zero: 1ms or 256 messages)
+    MqmFairScheduler(const MqmThreadPoolPtr& pool, MqmFairCost cost = MqmFairCost::Time,
+                     double quantum = 0);
+
+    MqmFairScheduler(const MqmFairScheduler&) = delete;
+    MqmFairScheduler& operator=(const MqmFairScheduler&) = delete;
+
+    void weigh(size_t tenant, double weight);
+
+    void post(size_t tenant, std::function<void()> task);
+
+    // counts consumed values for the task running on the calling thread
+    // (MqmFairCost::Messages), a no-op elsewhere
+    static void charge(size_t messages);
+};
+
+using MqmFairSchedulerPtr = std::shared_ptr<MqmFairScheduler>;
+
+}
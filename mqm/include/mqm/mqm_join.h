@@ -0,0 +1,110 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+namespace mqm
+{
+
+// symmetric hash join state of two streams within a time bound: entries live
+// in a ring arena of 'capacity' slots in arrival order, chained per join key
+// and side by sequence number, so evicting the oldest is a head move and
+// a chain simply ends at the first evicted entry; an entry is dropped once
+// the other side's newest time is past its bound (each side is assumed to
+// come roughly in time order), or when a full arena needs its slot;
+// not thread-safe, owned by a single drain task
+template<typename JoinKey, typename Value>
+class MqmJoin
+{
+    static constexpr uint64_t Nil = std::numeric_limits<uint64_t>::max();
+
+    struct Entry
+    {
+        JoinKey key;
+        Value value;
+        int64_t time;
+        bool right;
+        uint64_t older;     // previous entry of the same key and side
+    };
+
+    struct Heads
+    {
+        uint64_t newest[2] = { Nil, Nil };
+    };
+
+    const int64_t bound_;
+    const size_t capacity_;
+    std::vector<Entry> ring_;
+    uint64_t head_ = 0;     // live entries [head_, tail_)
+    uint64_t tail_ = 0;
+    std::unordered_map<JoinKey, Heads> index_;
+    int64_t newest_[2] = { std::numeric_limits<int64_t>::min(), std::numeric_limits<int64_t>::min() };
+
+    Entry& at(uint64_t seq) { return ring_[seq % capacity_]; }
+
+    bool live(uint64_t seq) const { return seq != Nil && seq >= head_; }
+
+    bool expired(const Entry& e) const
+    {
+        int64_t other = newest_[!e.right];
+        return other != std::numeric_limits<int64_t>::min() && e.time < other - bound_;
+    }
+
+    void evict()
+    {
+        auto i = index_.find(at(head_).key);
+        ++head_;
+        if (i != index_.end() && !live(i->second.newest[0]) && !live(i->second.newest[1]))
+            index_.erase(i);
+    }
+
+public:
+    MqmJoin(std::chrono::nanoseconds bound, size_t capacity)
+        : bound_(bound.count())
+        , capacity_(capacity ? capacity : 1)
+    {
+        ring_.reserve(capacity_);
+        index_.reserve(capacity_);
+    }
+
+    // matches 'value' against the other side, 'emit(left, right)' per pair
+    // within the bound, then keeps it for the later values of the other side
+    template<typename Emit>
+    void add(bool right, const JoinKey& key, std::chrono::nanoseconds time, const Value& value, Emit&& emit)
+    {
+        int64_t t = time.count();
+        if (t > newest_[right])
+            newest_[right] = t;
+        while (head_ != tail_ && (tail_ - head_ == capacity_ || expired(at(head_))))
+            evict();
+
+        auto& heads = index_[key];
+        for (uint64_t seq = heads.newest[!right]; live(seq); seq = at(seq).older)
+        {
+            auto& e = at(seq);
+            if (e.time - t <= bound_ && t - e.time <= bound_)
+            {
+                if (right)
+                    emit(e.value, value);
+                else
+                    emit(value, e.value);
+            }
+        }
+
+        Entry entry{ key, value, t, right, heads.newest[right] };
+        if (ring_.size() < capacity_)
+            ring_.push_back(std::move(entry));
+        else
+            at(tail_) = std::move(entry);
+        heads.newest[right] = tail_++;
+    }
+
+    size_t size() const { return static_cast<size_t>(tail_ - head_); }
+};
+
+template<typename JoinKey, typename Value>
+constexpr uint64_t MqmJoin<JoinKey, Value>::Nil;
+
+}
@@ -0,0 +1,147 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace mqm
+{
+
+// latest value of a key, readable by any thread; values that aren't
+// trivially copyable can't be read while being overwritten, so they are
+// kept as an immutable copy behind a shared pointer swapped with
+// std::atomic_store (one allocation per store; libstdc++ guards the swap
+// and the load with a short hashed lock, never held while copying a value),
+// trivially copyable ones are read without a lock, see below
+template<typename Value, typename Enable = void>
+class MqmLatest
+{
+    std::shared_ptr<const Value> value_;
+
+public:
+    void store(const Value& v)
+    {
+        std::atomic_store(&value_, std::make_shared<const Value>(v));
+    }
+
+    // 'f(const Value&)' on the latest value, false while nothing is stored
+    template<typename F>
+    bool read(F&& f) const
+    {
+        auto value = std::atomic_load(&value_);
+        if (!value)
+            return false;
+        f(*value);
+        return true;
+    }
+
+    bool load(Value& v) const
+    {
+        return read([&v](const Value& value) { v = value; });
+    }
+
+    bool empty() const { return !std::atomic_load(&value_); }
+};
+
+// trivially copyable values: a seqlock, the value is copied in and out
+// as relaxed atomic words between two reads of the sequence, which is odd
+// while a store is in progress, so a reader retries on a torn copy
+// and never blocks a writer; writers are serialized by a CAS on the sequence
+template<typename Value>
+class MqmLatest<Value, typename std::enable_if<std::is_trivially_copyable<Value>::value>::type>
+{
+    static constexpr size_t Words = (sizeof(Value) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    std::atomic<uint64_t> seq_{ 0 };    // zero - nothing stored yet
+    std::atomic<uint64_t> words_[Words];
+
+public:
+    MqmLatest()
+    {
+        for (auto& w : words_)
+            w.store(0, std::memory_order_relaxed);
+    }
+
+    void store(const Value& v)
+    {
+        uint64_t data[Words] = {};
+        std::memcpy(data, &v, sizeof(Value));
+
+        uint64_t seq = seq_.load(std::memory_order_relaxed);
+        while ((seq & 1) || !seq_.compare_exchange_weak(seq, seq + 1, std::memory_order_acquire))
+            if (seq & 1)
+            {
+                std::this_thread::yield();
+                seq = seq_.load(std::memory_order_relaxed);
+            }
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < Words; ++i)
+            words_[i].store(data[i], std::memory_order_relaxed);
+        seq_.store(seq + 2, std::memory_order_release);
+    }
+
+    // the copy is taken into raw words, so Value needs no default constructor
+    template<typename F>
+    bool read(F&& f) const
+    {
+        alignas(uint64_t) alignas(Value) uint64_t data[Words];
+        for (;;)
+        {
+            uint64_t seq = seq_.load(std::memory_order_acquire);
+            if (!seq)
+                return false;
+            if (seq & 1)
+                continue;
+            for (size_t i = 0; i < Words; ++i)
+                data[i] = words_[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq_.load(std::memory_order_relaxed) == seq)
+                break;
+        }
+        f(*reinterpret_cast<const Value*>(data));
+        return true;
+    }
+
+    bool load(Value& v) const
+    {
+        return read([&v](const Value& value) { std::memcpy(&v, &value, sizeof(Value)); });
+    }
+
+    bool empty() const { return !seq_.load(std::memory_order_acquire); }
+};
+
+template<typename Value>
+constexpr size_t MqmLatest<Value, typename std::enable_if<std::is_trivially_copyable<Value>::value>::type>::Words;
+
+template<typename Value>
+using MqmLatestPtr = std::shared_ptr<MqmLatest<Value>>;
+
+// an immutable value published to readers on any thread through an atomic
+// pointer, no lock and no reference count; a replaced copy may still be
+// read, so it is kept until this goes: for state that rarely changes;
+// publish() by one writer at a time
+template<typename T>
+class MqmPublished
+{
+    std::atomic<const T*> current_{ nullptr };
+    std::vector<std::unique_ptr<const T>> copies_;
+
+public:
+    MqmPublished() { publish(T()); }
+
+    MqmPublished(const MqmPublished&) = delete;
+    MqmPublished& operator=(const MqmPublished&) = delete;
+
+    const T& get() const { return *current_.load(std::memory_order_acquire); }
+
+    void publish(T&& value)
+    {
+        copies_.emplace_back(new T(std::move(value)));
+        current_.store(copies_.back().get(), std::memory_order_release);
+    }
+};
+
+}
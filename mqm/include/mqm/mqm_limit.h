@@ -0,0 +1,56 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace mqm
+{
+
+// where a rate limit holds values back
+enum class MqmLimitMode
+{
+    Reject, // enqueue() throws when the bucket is short (a batch lets in what fits)
+    Delay,  // enqueue() waits for the tokens, the producer is slowed down
+    Pace    // values are queued freely, the drain waits before dispatching them
+};
+
+// token bucket as GCRA: the whole state is one atomic 'theoretical arrival
+// time', so taking tokens is a CAS, lock-free and shareable by any number
+// of keys and threads; 'rate' tokens per second, up to 'burst' at once
+class MqmTokenBucket
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+private:
+    const int64_t interval_;    // per token
+    const int64_t tolerance_;   // burst
+    const size_t burst_;
+    std::atomic<int64_t> tat_{ 0 };
+
+    static int64_t now() { return Clock::now().time_since_epoch().count(); }
+
+public:
+    MqmTokenBucket(double rate, size_t burst);
+
+    // all or nothing: zero when taken, otherwise the wait until they would be
+    Clock::duration tryTake(size_t tokens);
+
+    // as many of the tokens as there are now, the count taken
+    size_t tryTakeSome(size_t tokens);
+
+    // how long until 'tokens' (at most a burst) could be taken, zero - now
+    Clock::duration wait(size_t tokens) const;
+
+    // takes the tokens now and waits until they are covered, any number of them
+    // (a waiting pool worker is marked blocked, see MqmThreadPool::Blocking)
+    void take(size_t tokens);
+
+    size_t burst() const { return burst_; }
+};
+
+using MqmTokenBucketPtr = std::shared_ptr<MqmTokenBucket>;
+
+}
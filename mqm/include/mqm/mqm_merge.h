@@ -0,0 +1,135 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace mqm
+{
+
+// k-way merge of time-ordered inputs into one stream: each input buffers its
+// values, a heap of the inputs with buffered values picks the oldest head,
+// and values are released only up to the watermark, the oldest of the inputs'
+// latest times (an input idle for longer than 'idle' isn't waited for,
+// its later values may come out behind newer ones of the others);
+// an input's values keep their arrival order, an older time is taken as
+// the latest one; buffers and heap are reused, so the steady state doesn't
+// allocate; not thread-safe, owned by a single drain task
+template<typename Value>
+class MqmMerge
+{
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr int64_t Never = std::numeric_limits<int64_t>::min();
+
+    struct Entry
+    {
+        int64_t time;
+        Value value;
+    };
+
+    struct Input
+    {
+        std::vector<Entry> buffer;
+        size_t head = 0;
+        int64_t latest = Never;
+        Clock::time_point active;
+    };
+
+    const Clock::duration idle_;
+    std::vector<Input> inputs_;
+    std::vector<size_t> heap_;
+
+    // min-heap by head time, then by input
+    bool later(size_t a, size_t b) const
+    {
+        auto& x = inputs_[a];
+        auto& y = inputs_[b];
+        int64_t ta = x.buffer[x.head].time;
+        int64_t tb = y.buffer[y.head].time;
+        return ta != tb ? ta > tb : a > b;
+    }
+
+    void pushHeap(size_t input)
+    {
+        heap_.push_back(input);
+        std::push_heap(heap_.begin(), heap_.end(), [this](size_t a, size_t b) { return later(a, b); });
+    }
+
+    size_t popHeap()
+    {
+        std::pop_heap(heap_.begin(), heap_.end(), [this](size_t a, size_t b) { return later(a, b); });
+        size_t input = heap_.back();
+        heap_.pop_back();
+        return input;
+    }
+
+    int64_t watermark(Clock::time_point now) const
+    {
+        int64_t mark = std::numeric_limits<int64_t>::max();
+        for (auto& input : inputs_)
+            if (!idle_.count() || now - input.active < idle_)
+                mark = std::min(mark, input.latest);
+        return mark;
+    }
+
+public:
+    MqmMerge(size_t inputs, std::chrono::milliseconds idle = {})
+        : idle_(idle)
+        , inputs_(inputs)
+    {
+        heap_.reserve(inputs);
+        auto now = Clock::now();
+        for (auto& input : inputs_)
+            input.active = now;
+    }
+
+    void push(size_t input, std::chrono::nanoseconds time, const Value& value)
+    {
+        auto& in = inputs_[input];
+        in.latest = std::max(in.latest, static_cast<int64_t>(time.count()));
+        in.active = Clock::now();
+
+        bool empty = in.head == in.buffer.size();
+        if (empty)
+        {
+            in.buffer.clear();
+            in.head = 0;
+        }
+        else if (in.head && in.buffer.size() == in.buffer.capacity())
+        {
+            in.buffer.erase(in.buffer.begin(), in.buffer.begin() + in.head);
+            in.head = 0;
+        }
+        in.buffer.push_back({ in.latest, value });
+        if (empty)
+            pushHeap(input);
+    }
+
+    // 'emit(Value&&)' in time order, up to the watermark
+    template<typename Emit>
+    void drain(Emit&& emit)
+    {
+        int64_t mark = watermark(Clock::now());
+        while (!heap_.empty())
+        {
+            auto& top = inputs_[heap_.front()];
+            if (top.buffer[top.head].time > mark)
+                break;
+
+            size_t input = popHeap();
+            auto& in = inputs_[input];
+            emit(std::move(in.buffer[in.head].value));
+            if (++in.head != in.buffer.size())
+                pushHeap(input);
+        }
+    }
+
+    size_t inputs() const { return inputs_.size(); }
+};
+
+template<typename Value>
+constexpr int64_t MqmMerge<Value>::Never;
+
+}
@@ -0,0 +1,149 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mqm
+{
+
+// bounds + scaling rules of an elastic pool
+// (grow/shrink streaks are counted in consecutive samples, that's the hysteresis)
+struct MqmPoolLimits
+{
+    size_t minThreads = 1;
+    size_t maxThreads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    std::chrono::milliseconds interval{ 100 };
+    double highUtilization = 0.85;
+    double lowUtilization = 0.25;
+    size_t growAfter = 2;
+    size_t shrinkAfter = 20;
+};
+
+// worker threads + FIFO of tasks,
+// fixed size, or elastic between MqmPoolLimits bounds
+class MqmThreadPool
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Worker
+    {
+        std::thread thread;
+        bool done = false;
+    };
+
+    std::deque<std::function<void()>> tasks_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    bool stopped_ = false;
+    std::list<Worker> workers_;
+    std::atomic<size_t> size_{ 0 };
+    size_t retire_ = 0;
+
+    // scaling
+    const MqmPoolLimits limits_;
+    std::thread monitor_;
+    std::condition_variable monitorCv_;
+    std::atomic<size_t> active_{ 0 };
+    std::atomic<size_t> blocked_{ 0 };
+    std::atomic<int64_t> busy_{ 0 };
+    std::atomic<int64_t> blockedTime_{ 0 };
+
+    void spawn();
+    void work(Worker& self);
+    void monitor();
+
+public:
+    explicit MqmThreadPool(size_t threads = std::thread::hardware_concurrency());
+    explicit MqmThreadPool(const MqmPoolLimits& limits);
+    ~MqmThreadPool();
+
+    MqmThreadPool(const MqmThreadPool&) = delete;
+    MqmThreadPool& operator=(const MqmThreadPool&) = delete;
+
+    size_t size() const { return size_; }
+
+    // tasks waiting for a worker
+    size_t depth();
+
+    void post(std::function<void()> task);
+
+    // marks the calling pool worker as blocked (I/O, sleeping in a consumer ...)
+    // for its lifetime, blocked workers are replaced when ready tasks wait;
+    // a no-op on threads that are not pool workers
+    class Blocking
+    {
+        MqmThreadPool* pool_;
+        Clock::time_point start_;
+
+    public:
+        Blocking();
+        ~Blocking();
+
+        Blocking(const Blocking&) = delete;
+        Blocking& operator=(const Blocking&) = delete;
+    };
+
+    // fork-join: calls fn(i) for every i in [0, count) on the pool,
+    // the calling thread takes part too, so it is safe to call from a pool task;
+    // rethrows the first exception once all calls are done
+    template<typename Fn>
+    void run(size_t count, const Fn& fn)
+    {
+        struct Join
+        {
+            std::atomic<size_t> next{ 0 };
+            std::atomic<size_t> done{ 0 };
+            std::exception_ptr error;
+            std::mutex mtx;
+            std::condition_variable cv;
+        };
+        auto join = std::make_shared<Join>();
+
+        // 'fn' is only touched while some index is still pending,
+        // i.e. before run() is allowed to return
+        auto task = [join, count, &fn]() {
+            for (size_t i = join->next++; i < count; i = join->next++)
+            {
+                try
+                {
+                    fn(i);
+                }
+                catch (...)
+                {
+                    std::unique_lock<std::mutex> lock{ join->mtx };
+                    if (!join->error)
+                        join->error = std::current_exception();
+                }
+                if (++join->done == count)
+                {
+                    std::unique_lock<std::mutex> lock{ join->mtx };
+                    join->cv.notify_all();
+                }
+            }
+        };
+
+        size_t helpers = count ? std::min(count - 1, size()) : 0;
+        for (size_t i = 0; i < helpers; ++i)
+            post(task);
+        task();
+
+        std::unique_lock<std::mutex> lock{ join->mtx };
+        while (join->done < count)
+            join->cv.wait(lock);
+        if (join->error)
+            std::rethrow_exception(join->error);
+    }
+};
+
+using MqmThreadPoolPtr = std::shared_ptr<MqmThreadPool>;
+
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+
+namespace boost { namespace interprocess { class file_mapping; class mapped_region; } }
+
+namespace mqm
+{
+
+// snapshot file of pending queues: a magic header, then per key
+// [uint32 size][key][uint64 values] followed by its values, each
+// [uint32 size][value], keys and values encoded with MqmCodec
+
+// written sequentially through one large buffer, records are encoded
+// straight into it; the file is written aside and renamed into place
+// by close(), so a crash never leaves a partial snapshot at 'path'
+class MqmSnapshotWriter
+{
+    const std::string path_;
+    const std::string temp_;
+    std::ofstream out_;
+    std::string buffer_;
+    size_t mark_ = 0;
+
+    void flush();
+
+public:
+    explicit MqmSnapshotWriter(const std::string& path);
+    ~MqmSnapshotWriter();
+
+    MqmSnapshotWriter(const MqmSnapshotWriter&) = delete;
+    MqmSnapshotWriter& operator=(const MqmSnapshotWriter&) = delete;
+
+    // a record is appended to the returned buffer between begin() and end()
+    std::string& begin();
+    void end();
+
+    // an already encoded record
+    void record(const char* data, size_t size);
+
+    void count(uint64_t values);
+
+    void close();
+};
+
+// reads a snapshot in place from a read-only mapping,
+// records point into it until the reader is gone
+class MqmSnapshotReader
+{
+    std::unique_ptr<boost::interprocess::file_mapping> file_;
+    std::unique_ptr<boost::interprocess::mapped_region> region_;
+    const char* pos_ = nullptr;
+    const char* end_ = nullptr;
+
+public:
+    explicit MqmSnapshotReader(const std::string& path);
+    ~MqmSnapshotReader();
+
+    MqmSnapshotReader(const MqmSnapshotReader&) = delete;
+    MqmSnapshotReader& operator=(const MqmSnapshotReader&) = delete;
+
+    // false at the end of the file
+    bool record(const char*& data, size_t& size);
+
+    // values of a key, never more than the rest of the file can hold
+    uint64_t count();
+};
+
+}
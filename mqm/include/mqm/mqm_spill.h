@@ -0,0 +1,95 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+namespace boost { namespace interprocess { class mapped_region; } }
+
+namespace mqm
+{
+
+// how a value is written to a spill file: 'write' appends its bytes to 'out',
+// 'read' rebuilds it from them; trivially copyable values and std::string
+// work out of the box, other types specialise MqmCodec
+template<typename Value, typename Enable = void>
+struct MqmCodec;
+
+template<typename Value>
+struct MqmCodec<Value, typename std::enable_if<std::is_trivially_copyable<Value>::value>::type>
+{
+    static void write(const Value& v, std::string& out)
+    {
+        out.append(reinterpret_cast<const char*>(&v), sizeof(Value));
+    }
+
+    static Value read(const char* data, size_t size)
+    {
+        if (size != sizeof(Value))
+            throw std::runtime_error("Can't restore, value size doesn't match its type");
+        Value v;
+        std::memcpy(&v, data, sizeof(Value));
+        return v;
+    }
+};
+
+template<>
+struct MqmCodec<std::string>
+{
+    static void write(const std::string& v, std::string& out) { out.append(v); }
+    static std::string read(const char* data, size_t size) { return std::string(data, size); }
+};
+
+// append-only record log in memory-mapped segment files: records are copied
+// into the mapping, so appending costs no syscall (one per new segment),
+// and are read back in order; a fully read segment is deleted, or reused
+// when it is the one being written; only the segments being written and
+// read are mapped; not thread-safe, owned by one source under its lock
+class MqmSpill
+{
+    struct Segment
+    {
+        std::string path;
+        size_t size = 0;
+        size_t end = 0;     // written
+        size_t pos = 0;     // read
+        std::unique_ptr<boost::interprocess::mapped_region> region;
+    };
+
+    const std::string directory_;
+    const size_t segmentSize_;
+    std::deque<Segment> segments_;  // the front is read, the back is written
+    size_t records_ = 0;
+
+    void create(size_t size);
+    void map(Segment& s);
+    void unmap(Segment& s);
+    void remove(Segment& s);
+
+public:
+    explicit MqmSpill(const std::string& directory, size_t segmentSize = size_t(64) << 20);
+    ~MqmSpill();
+
+    MqmSpill(const MqmSpill&) = delete;
+    MqmSpill& operator=(const MqmSpill&) = delete;
+
+    void append(const char* data, size_t size);
+
+    // the oldest record, false when there is none
+    bool front(const char*& data, size_t& size);
+    void pop();
+
+    // every record in order, left in place
+    void read(const std::function<void(const char*, size_t)>& record);
+
+    size_t records() const { return records_; }
+    bool empty() const { return !records_; }
+    const std::string& directory() const { return directory_; }
+    size_t segmentSize() const { return segmentSize_; }
+};
+
+}
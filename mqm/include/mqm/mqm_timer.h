@@ -0,0 +1,149 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mqm
+{
+
+// hierarchical timing wheel (Varghese & Lauck, as in the Linux/Kafka timers):
+// 4 levels of 256 slots, add() is O(1), items sink a level each time
+// the slot they wait in is reached; ticks are abstract, the owner maps them to time
+// (not thread-safe)
+template<typename T>
+class MqmTimingWheel
+{
+public:
+    static constexpr unsigned Bits = 8;
+    static constexpr uint64_t Slots = uint64_t(1) << Bits;
+    static constexpr uint64_t Mask = Slots - 1;
+    static constexpr unsigned Levels = 4;
+    static constexpr uint64_t Never = std::numeric_limits<uint64_t>::max();
+
+private:
+    struct Item
+    {
+        uint64_t due;
+        T value;
+    };
+
+    std::vector<Item> slots_[Levels][Slots];
+    std::vector<Item> overflow_;
+    uint64_t now_ = 0;
+    size_t size_ = 0;
+
+    void place(Item&& item)
+    {
+        uint64_t due = std::max(item.due, now_);
+        uint64_t delta = due - now_;
+        for (unsigned level = 0; level < Levels; ++level)
+            if (delta < (uint64_t(1) << (Bits * (level + 1))))
+                return slots_[level][(due >> (Bits * level)) & Mask].push_back(std::move(item));
+        overflow_.push_back(std::move(item));
+    }
+
+    void cascade(unsigned level)
+    {
+        std::vector<Item> items;
+        items.swap(slots_[level][(now_ >> (Bits * level)) & Mask]);
+        for (auto& item : items)
+            place(std::move(item));
+    }
+
+public:
+    size_t size() const { return size_; }
+    uint64_t now() const { return now_; }
+
+    void add(uint64_t due, T&& value)
+    {
+        ++size_;
+        place({ due, std::move(value) });
+    }
+
+    // earliest tick worth an advance(): a pending level 0 slot,
+    // or the next turn of level 0 that cascades the level above
+    uint64_t next() const
+    {
+        if (!size_)
+            return Never;
+        for (uint64_t tick = now_; tick < now_ + Slots; ++tick)
+            if (!slots_[0][tick & Mask].empty())
+                return tick;
+        return ((now_ >> Bits) + 1) << Bits;
+    }
+
+    // turns the wheel up to 'tick', items due by then are appended to 'due'
+    void advance(uint64_t tick, std::vector<T>& due)
+    {
+        for (;;)
+        {
+            auto& slot = slots_[0][now_ & Mask];
+            for (auto& item : slot)
+                due.push_back(std::move(item.value));
+            size_ -= slot.size();
+            slot.clear();
+
+            if (now_ >= tick)
+                return;
+            if (!size_)
+            {
+                now_ = tick;
+                continue;
+            }
+
+            ++now_;
+            for (unsigned level = 1; level < Levels && !(now_ & ((uint64_t(1) << (Bits * level)) - 1)); ++level)
+            {
+                cascade(level);
+                if (level == Levels - 1)
+                {
+                    std::vector<Item> items;
+                    items.swap(overflow_);
+                    for (auto& item : items)
+                        place(std::move(item));
+                }
+            }
+        }
+    }
+};
+
+// one thread firing callbacks at their due time, on a 1ms timing wheel
+// (callbacks run on the timer thread, keep them short)
+class MqmTimer
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    using Tick = std::chrono::milliseconds;
+
+private:
+    const Clock::time_point start_ = Clock::now();
+    MqmTimingWheel<std::function<void()>> wheel_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    bool stopped_ = false;
+    std::thread thread_;
+
+    uint64_t tick(Clock::time_point when) const;
+    void run();
+
+public:
+    MqmTimer();
+    ~MqmTimer();
+
+    MqmTimer(const MqmTimer&) = delete;
+    MqmTimer& operator=(const MqmTimer&) = delete;
+
+    void schedule(Clock::duration delay, std::function<void()> task);
+    void at(Clock::time_point when, std::function<void()> task);
+};
+
+using MqmTimerPtr = std::shared_ptr<MqmTimer>;
+
+}
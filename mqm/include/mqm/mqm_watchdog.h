@@ -0,0 +1,131 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mqm
+{
+
+// stamped by a drain when a batch starts, cleared when it ends
+class MqmHeartbeat
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+private:
+    std::atomic<Clock::rep> since_{ 0 };
+
+public:
+    void start() { since_.store(Clock::now().time_since_epoch().count(), std::memory_order_relaxed); }
+    void stop() { since_.store(0, std::memory_order_relaxed); }
+
+    // start of the current batch, 0 when idle
+    Clock::rep since() const { return since_.load(std::memory_order_relaxed); }
+};
+
+using MqmHeartbeatPtr = std::shared_ptr<MqmHeartbeat>;
+
+// one thread polling heartbeats every quarter of 'budget',
+// a batch running longer than 'budget' is reported once
+template<typename Key>
+class MqmWatchdog
+{
+    using Clock = MqmHeartbeat::Clock;
+    using Handler = std::function<void(const Key&, std::chrono::milliseconds)>;
+
+    struct Entry
+    {
+        Key key;
+        std::weak_ptr<MqmHeartbeat> heartbeat;
+        Clock::rep reported;
+    };
+
+    const Clock::duration budget_;
+    const Handler onStuck_;
+    std::vector<Entry> entries_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    bool stopped_ = false;
+    std::thread thread_;
+
+    void check()
+    {
+        std::vector<std::pair<Key, Clock::duration>> stuck;
+        {
+            std::unique_lock<std::mutex> lock{ mtx_ };
+            auto now = Clock::now().time_since_epoch().count();
+            for (auto i = entries_.begin(); i != entries_.end(); )
+            {
+                auto heartbeat = i->heartbeat.lock();
+                if (!heartbeat)
+                {
+                    i = entries_.erase(i);
+                    continue;
+                }
+                auto since = heartbeat->since();
+                if (since && since != i->reported && Clock::duration(now - since) > budget_)
+                {
+                    i->reported = since;
+                    stuck.emplace_back(i->key, Clock::duration(now - since));
+                }
+                ++i;
+            }
+        }
+
+        for (auto& s : stuck)
+            try
+            {
+                onStuck_(s.first, std::chrono::duration_cast<std::chrono::milliseconds>(s.second));
+            }
+            catch (const std::exception& e)
+            {
+                std::cout << "watchdog error: " << e.what() << "\n";
+            }
+    }
+
+public:
+    MqmWatchdog(std::chrono::milliseconds budget, Handler onStuck)
+        : budget_(budget)
+        , onStuck_(std::move(onStuck))
+    {
+        auto period = std::max<Clock::duration>(budget_ / 4, std::chrono::milliseconds(1));
+        thread_ = std::thread([this, period]() {
+            std::unique_lock<std::mutex> lock{ mtx_ };
+            while (!stopped_)
+            {
+                cv_.wait_for(lock, period);
+                lock.unlock();
+                check();
+                lock.lock();
+            }
+        });
+    }
+
+    ~MqmWatchdog()
+    {
+        {
+            std::unique_lock<std::mutex> lock{ mtx_ };
+            stopped_ = true;
+            cv_.notify_all();
+        }
+        thread_.join();
+    }
+
+    void watch(const Key& key, const MqmHeartbeatPtr& heartbeat)
+    {
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        entries_.push_back({ key, heartbeat, 0 });
+    }
+};
+
+template<typename Key>
+using MqmWatchdogPtr = std::shared_ptr<MqmWatchdog<Key>>;
+
+}
@@ -0,0 +1,130 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+namespace mqm
+{
+
+// tumbling ('slide' zero or equal to 'size') or sliding windows,
+// 'size' must be a multiple of 'slide'; windows are aligned to the clock's epoch
+struct MqmWindowSpec
+{
+    std::chrono::milliseconds size{ 1000 };
+    std::chrono::milliseconds slide{};
+};
+
+// window state of one key: a ring of size/slide panes allocated up front,
+// each pane aggregates the values of one slide and a window is merged
+// from its panes once time passes its end, so a value costs one add()
+// ('Agg': default constructible, add(const Value&), merge(const Agg&));
+// not thread-safe, owned by a single drain task
+template<typename Agg>
+class MqmWindow
+{
+    struct Pane
+    {
+        Agg agg{};
+        size_t count = 0;
+    };
+
+    const int64_t slide_;
+    std::vector<Pane> panes_;
+    int64_t open_ = 0;              // first pane of the oldest window not emitted yet
+    bool started_ = false;
+
+    static int64_t checked(const MqmWindowSpec& spec)
+    {
+        auto slide = spec.slide.count() ? spec.slide : spec.size;
+        if (slide.count() <= 0 || spec.size.count() % slide.count() != 0)
+            throw std::invalid_argument("MqmWindow size must be a positive multiple of slide");
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(slide).count();
+    }
+
+    int64_t count() const { return static_cast<int64_t>(panes_.size()); }
+
+    int64_t paneOf(std::chrono::nanoseconds time) const
+    {
+        int64_t t = time.count();
+        return t / slide_ - (t % slide_ < 0 ? 1 : 0);
+    }
+
+    Pane& pane(int64_t p)
+    {
+        int64_t i = p % count();
+        return panes_[i < 0 ? i + count() : i];
+    }
+
+    // emits and drops the windows that end at or before pane 'p'
+    template<typename Emit>
+    void close(int64_t p, Emit&& emit)
+    {
+        const int64_t n = count();
+        for (int64_t last = std::min(p - n, open_ + n - 1); open_ <= last; ++open_)
+        {
+            std::chrono::nanoseconds start{ open_ * slide_ };
+            if (n == 1)
+            {
+                if (pane(open_).count)
+                    emit(start, pane(open_).agg);
+            }
+            else
+            {
+                Agg window{};
+                size_t values = 0;
+                for (int64_t q = open_; q < open_ + n; ++q)
+                    if (pane(q).count)
+                    {
+                        window.merge(pane(q).agg);
+                        values += pane(q).count;
+                    }
+                if (values)
+                    emit(start, window);
+            }
+            pane(open_) = Pane();
+        }
+        if (open_ < p - n + 1)
+            open_ = p - n + 1;
+    }
+
+public:
+    explicit MqmWindow(const MqmWindowSpec& spec)
+        : slide_(checked(spec))
+        , panes_(static_cast<size_t>(spec.size / (spec.slide.count() ? spec.slide : spec.size))) { }
+
+    // false: 'time' is behind the oldest open window, the value is dropped;
+    // windows it moves past are emitted first, 'emit(start, agg)'
+    template<typename Value, typename Emit>
+    bool add(std::chrono::nanoseconds time, const Value& value, Emit&& emit)
+    {
+        int64_t p = paneOf(time);
+        if (!started_)
+        {
+            started_ = true;
+            open_ = p - count() + 1;
+        }
+        else if (p >= open_ + count())
+            close(p, emit);
+        if (p < open_)
+            return false;
+
+        Pane& x = pane(p);
+        x.agg.add(value);
+        ++x.count;
+        return true;
+    }
+
+    // emits the windows that ended at or before 'now'
+    template<typename Emit>
+    void advance(std::chrono::nanoseconds now, Emit&& emit)
+    {
+        if (started_)
+            close(paneOf(now), emit);
+    }
+
+    std::chrono::nanoseconds slide() const { return std::chrono::nanoseconds(slide_); }
+};
+
+}
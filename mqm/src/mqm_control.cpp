@@ -0,0 +1,52 @@
+#include "mqm/mqm_control.h"
+#include <algorithm>
+
+namespace mqm
+{
+
+constexpr size_t MqmBatchController::Window;
+constexpr size_t MqmBatchController::Period;
+
+MqmBatchController::MqmBatchController(std::chrono::microseconds target, size_t minBatch, size_t maxBatch)
+    : target_(target)
+    , minBatch_(std::max<size_t>(minBatch, 1))
+    , maxBatch_(std::max(maxBatch, minBatch_))
+    , maxLinger_(target / 2)
+    , batch_(minBatch_)
+{
+}
+
+void MqmBatchController::record(Clock::duration wait, Clock::duration consume)
+{
+    samples_[count_++ % Window] = wait + consume;
+    if (count_ % Period == 0)
+        adjust();
+}
+
+void MqmBatchController::adjust()
+{
+    std::array<Clock::duration, Window> sorted;
+    size_t n = std::min(count_, Window);
+    std::copy_n(samples_.begin(), n, sorted.begin());
+    auto p = sorted.begin() + (n * 99) / 100;
+    std::nth_element(sorted.begin(), p, sorted.begin() + n);
+    p99_ = *p;
+
+    if (p99_ > target_)
+    {
+        batch_ = std::max(batch_ / 2, minBatch_);
+        linger_ /= 2;
+    }
+    else
+    {
+        batch_ = std::min(batch_ + std::max<size_t>(minBatch_, 8), maxBatch_);
+        linger_ = std::min(linger_ + std::max(maxLinger_ / 32, Clock::duration{ 1 }), maxLinger_);
+    }
+}
+
+std::chrono::microseconds MqmBatchController::linger() const
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(linger_);
+}
+
+}
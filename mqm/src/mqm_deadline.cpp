@@ -0,0 +1,68 @@
+#include "mqm/mqm_deadline.h"
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+namespace mqm
+{
+
+namespace
+{
+struct Later
+{
+    template<typename Ready>
+    bool operator()(const Ready& a, const Ready& b) const
+    {
+        return a.deadline != b.deadline ? a.deadline > b.deadline : a.seq > b.seq;
+    }
+};
+}
+
+MqmDeadlineScheduler::MqmDeadlineScheduler(const MqmThreadPoolPtr& pool)
+    : pool_(pool)
+{
+    if (!pool_)
+        throw std::invalid_argument("MqmDeadlineScheduler needs a pool");
+}
+
+void MqmDeadlineScheduler::post(Clock::time_point deadline, std::function<void()> task)
+{
+    {
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        ready_.push_back({ deadline, seq_++, std::move(task) });
+        std::push_heap(ready_.begin(), ready_.end(), Later());
+    }
+    auto self = shared_from_this();
+    pool_->post([self]() { self->run(); });
+}
+
+size_t MqmDeadlineScheduler::depth()
+{
+    std::unique_lock<std::mutex> lock{ mtx_ };
+    return ready_.size();
+}
+
+// one pool run per posted task, each takes the task due first
+void MqmDeadlineScheduler::run()
+{
+    std::function<void()> task;
+    {
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        if (ready_.empty())
+            return;
+        std::pop_heap(ready_.begin(), ready_.end(), Later());
+        task = std::move(ready_.back().task);
+        ready_.pop_back();
+    }
+
+    try
+    {
+        task();
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << "deadline task error: " << e.what() << "\n";
+    }
+}
+
+}
@@ -0,0 +1,132 @@
+#include "mqm/mqm_dedup.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace mqm
+{
+
+namespace
+{
+const int BitsPerId = 16;
+const int BitsPerWord = 4;
+
+// the bits of an id within its word, from the low 24 bits of the hash
+uint64_t maskOf(uint64_t hash)
+{
+    uint64_t mask = 0;
+    for (int i = 0; i < BitsPerWord; ++i)
+        mask |= uint64_t(1) << ((hash >> (6 * i)) & 63);
+    return mask;
+}
+
+// the word of an id, from the high 32 bits of the hash
+size_t wordOf(uint64_t hash, size_t words)
+{
+    return static_cast<size_t>(((hash >> 32) * words) >> 32);
+}
+
+size_t slots(size_t capacity)
+{
+    size_t n = 2;
+    while (n < capacity * 2)
+        n <<= 1;
+    return n;
+}
+}
+
+MqmDedup::MqmDedup(Clock::duration window, size_t capacity, bool exact)
+    : window_(window)
+    , capacity_(std::max<size_t>(capacity, 1))
+    , exact_(exact)
+    , rotated_(Clock::now())
+{
+    if (window.count() <= 0)
+        throw std::invalid_argument("MqmDedup window must be positive");
+    for (auto& g : generations_)
+    {
+        g.bits.assign(std::max<size_t>(capacity_ * BitsPerId / 64, 1), 0);
+        if (exact_)
+            g.ids.assign(slots(capacity_), 0);
+    }
+}
+
+bool MqmDedup::test(const Generation& g, uint64_t hash, uint64_t mask) const
+{
+    return (g.bits[wordOf(hash, g.bits.size())] & mask) == mask;
+}
+
+bool MqmDedup::find(const Generation& g, uint64_t hash) const
+{
+    const size_t last = g.ids.size() - 1;
+    for (size_t i = hash & last;; i = (i + 1) & last)
+    {
+        if (g.ids[i] == hash)
+            return true;
+        if (!g.ids[i])
+            return false;
+    }
+}
+
+void MqmDedup::insert(Generation& g, uint64_t hash, uint64_t mask)
+{
+    g.bits[wordOf(hash, g.bits.size())] |= mask;
+    ++g.count;
+    if (!exact_)
+        return;
+    const size_t last = g.ids.size() - 1;
+    size_t i = hash & last;
+    while (g.ids[i])
+        i = (i + 1) & last;
+    g.ids[i] = hash;
+}
+
+void MqmDedup::rotate(Clock::time_point now)
+{
+    // two windows idle, the current generation is out of date too
+    if (now - rotated_ >= 2 * window_)
+    {
+        auto& last = generations_[current_];
+        std::fill(last.bits.begin(), last.bits.end(), 0);
+        std::fill(last.ids.begin(), last.ids.end(), 0);
+        last.count = 0;
+    }
+    current_ ^= 1;
+    auto& g = generations_[current_];
+    std::fill(g.bits.begin(), g.bits.end(), 0);
+    std::fill(g.ids.begin(), g.ids.end(), 0);
+    g.count = 0;
+    rotated_ = now;
+}
+
+bool MqmDedup::seen(uint64_t hash, Clock::time_point now)
+{
+    if (contains(hash, now))
+        return true;
+    remember(hash, now);
+    return false;
+}
+
+bool MqmDedup::contains(uint64_t hash, Clock::time_point now)
+{
+    if (!hash)
+        hash = 1;
+    if (now - rotated_ >= window_ || generations_[current_].count >= capacity_)
+        rotate(now);
+
+    const uint64_t mask = maskOf(hash);
+    for (auto& g : generations_)
+        if (g.count && test(g, hash, mask) && (!exact_ || find(g, hash)))
+            return true;
+    return false;
+}
+
+void MqmDedup::remember(uint64_t hash, Clock::time_point now)
+{
+    if (!hash)
+        hash = 1;
+    if (now - rotated_ >= window_ || generations_[current_].count >= capacity_)
+        rotate(now);
+    insert(generations_[current_], hash, maskOf(hash));
+}
+
+}
@@ -0,0 +1,114 @@
+#include "mqm/mqm_fair.h"
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+namespace mqm
+{
+
+namespace
+{
+thread_local size_t* currentCharge = nullptr;
+}
+
+MqmFairScheduler::MqmFairScheduler(const MqmThreadPoolPtr& pool, MqmFairCost cost, double quantum)
+    : pool_(pool)
+    , cost_(cost)
+    , quantum_(quantum > 0 ? quantum : cost == MqmFairCost::Time ? 1e6 : 256)
+{
+    if (!pool_)
+        throw std::invalid_argument("MqmFairScheduler needs a pool");
+}
+
+void MqmFairScheduler::weigh(size_t tenant, double weight)
+{
+    if (weight <= 0)
+        throw std::invalid_argument("MqmFairScheduler weight must be positive");
+    std::unique_lock<std::mutex> lock{ mtx_ };
+    tenants_[tenant].weight = weight;
+}
+
+void MqmFairScheduler::post(size_t tenant, std::function<void()> task)
+{
+    {
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        auto& t = tenants_[tenant];
+        t.ready.emplace_back(std::move(task));
+        if (!t.active)
+        {
+            t.active = true;
+            active_.push_back(tenant);
+        }
+    }
+    auto self = shared_from_this();
+    pool_->post([self]() { self->run(); });
+}
+
+void MqmFairScheduler::charge(size_t messages)
+{
+    if (currentCharge)
+        *currentCharge += messages;
+}
+
+// one pool run per posted task, each takes the next task in DRR order
+void MqmFairScheduler::run()
+{
+    size_t id = 0;
+    std::function<void()> task;
+    {
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        if (active_.empty())
+            return;
+        for (;;)
+        {
+            id = active_.front();
+            auto& t = tenants_[id];
+            if (t.deficit > 0)
+                break;
+            t.deficit += quantum_ * t.weight;
+            if (t.deficit > 0)
+                break;
+            active_.pop_front();
+            active_.push_back(id);
+        }
+
+        auto& t = tenants_[id];
+        task = std::move(t.ready.front());
+        t.ready.pop_front();
+        if (t.ready.empty())
+        {
+            // an idle tenant doesn't bank credit, its debt is kept
+            t.active = false;
+            t.deficit = std::min(t.deficit, 0.0);
+            active_.pop_front();
+        }
+    }
+
+    size_t messages = 0;
+    currentCharge = &messages;
+    auto start = Clock::now();
+    try
+    {
+        task();
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << "fair task error: " << e.what() << "\n";
+    }
+    currentCharge = nullptr;
+    double cost = cost_ == MqmFairCost::Time
+        ? double(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count())
+        : double(messages);
+    task = nullptr;
+
+    std::unique_lock<std::mutex> lock{ mtx_ };
+    auto& t = tenants_[id];
+    t.deficit -= cost;
+    if (t.deficit <= 0 && t.active && !active_.empty() && active_.front() == id)
+    {
+        active_.pop_front();
+        active_.push_back(id);
+    }
+}
+
+}
@@ -0,0 +1,75 @@
+#include "mqm/mqm_limit.h"
+#include "mqm/mqm_pool.h"
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+
+namespace mqm
+{
+
+MqmTokenBucket::MqmTokenBucket(double rate, size_t burst)
+    : interval_(static_cast<int64_t>(std::chrono::duration_cast<Clock::duration>(
+          std::chrono::duration<double>(rate > 0 ? 1 / rate : 0)).count()))
+    , tolerance_(interval_ * static_cast<int64_t>(std::max<size_t>(burst, 1)))
+    , burst_(std::max<size_t>(burst, 1))
+{
+    if (rate <= 0 || interval_ <= 0)
+        throw std::invalid_argument("MqmTokenBucket rate must be positive and finite");
+}
+
+MqmTokenBucket::Clock::duration MqmTokenBucket::tryTake(size_t tokens)
+{
+    const int64_t cost = interval_ * static_cast<int64_t>(tokens);
+    const int64_t t = now();
+    int64_t tat = tat_.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        int64_t next = std::max(tat, t) + cost;
+        if (next - t > tolerance_)
+            return Clock::duration(next - t - tolerance_);
+        if (tat_.compare_exchange_weak(tat, next, std::memory_order_relaxed))
+            return {};
+    }
+}
+
+size_t MqmTokenBucket::tryTakeSome(size_t tokens)
+{
+    const int64_t t = now();
+    int64_t tat = tat_.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        int64_t start = std::max(tat, t);
+        int64_t room = tolerance_ - (start - t);
+        size_t n = room > 0 ? std::min<size_t>(tokens, static_cast<size_t>(room / interval_)) : 0;
+        if (!n)
+            return 0;
+        if (tat_.compare_exchange_weak(tat, start + interval_ * static_cast<int64_t>(n), std::memory_order_relaxed))
+            return n;
+    }
+}
+
+MqmTokenBucket::Clock::duration MqmTokenBucket::wait(size_t tokens) const
+{
+    const int64_t t = now();
+    const int64_t cost = interval_ * static_cast<int64_t>(std::min(tokens, burst_));
+    const int64_t next = std::max(tat_.load(std::memory_order_relaxed), t) + cost;
+    return Clock::duration(std::max<int64_t>(next - t - tolerance_, 0));
+}
+
+void MqmTokenBucket::take(size_t tokens)
+{
+    const int64_t cost = interval_ * static_cast<int64_t>(tokens);
+    const int64_t t = now();
+    int64_t tat = tat_.load(std::memory_order_relaxed);
+    int64_t next = 0;
+    do
+        next = std::max(tat, t) + cost;
+    while (!tat_.compare_exchange_weak(tat, next, std::memory_order_relaxed));
+
+    if (next - t <= tolerance_)
+        return;
+    MqmThreadPool::Blocking blocking;
+    std::this_thread::sleep_for(Clock::duration(next - t - tolerance_));
+}
+
+}
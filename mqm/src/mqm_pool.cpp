@@ -0,0 +1,192 @@
+#include "mqm/mqm_pool.h"
+#include <iostream>
+#include <stdexcept>
+
+namespace mqm
+{
+
+namespace
+{
+thread_local MqmThreadPool* currentPool = nullptr;
+}
+
+MqmThreadPool::MqmThreadPool(size_t threads)
+    : limits_{ std::max<size_t>(threads, 1), std::max<size_t>(threads, 1) }
+{
+    std::unique_lock<std::mutex> lock{ mtx_ };
+    for (size_t i = 0; i < limits_.minThreads; ++i)
+        spawn();
+}
+
+MqmThreadPool::MqmThreadPool(const MqmPoolLimits& limits)
+    : limits_(limits)
+{
+    if (!limits_.maxThreads || limits_.minThreads > limits_.maxThreads)
+        throw std::invalid_argument("MqmThreadPool limits are inconsistent");
+
+    std::unique_lock<std::mutex> lock{ mtx_ };
+    for (size_t i = 0; i < std::max<size_t>(limits_.minThreads, 1); ++i)
+        spawn();
+    if (limits_.minThreads != limits_.maxThreads)
+        monitor_ = std::thread([this]() { monitor(); });
+}
+
+MqmThreadPool::~MqmThreadPool()
+{
+    {
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        stopped_ = true;
+        cv_.notify_all();
+        monitorCv_.notify_all();
+    }
+    if (monitor_.joinable())
+        monitor_.join();
+    for (auto& w : workers_)
+        if (w.thread.get_id() != std::this_thread::get_id())
+            w.thread.join();
+        else
+            w.thread.detach();
+
+    // the last reference was dropped by a task of this very pool,
+    // its worker leaves without touching the pool again (see work())
+    if (currentPool == this)
+        currentPool = nullptr;
+}
+
+// under mtx_
+void MqmThreadPool::spawn()
+{
+    workers_.emplace_back();
+    auto& w = workers_.back();
+    w.thread = std::thread([this, &w]() { work(w); });
+    ++size_;
+}
+
+size_t MqmThreadPool::depth()
+{
+    std::unique_lock<std::mutex> lock{ mtx_ };
+    return tasks_.size();
+}
+
+void MqmThreadPool::post(std::function<void()> task)
+{
+    std::unique_lock<std::mutex> lock{ mtx_ };
+    if (stopped_)
+        throw std::runtime_error("Can't post, pool is stopped");
+    tasks_.emplace_back(std::move(task));
+    cv_.notify_one();
+}
+
+// pending tasks are still run after stop, workers leave once the queue is empty
+void MqmThreadPool::work(Worker& self)
+{
+    currentPool = this;
+    for (;;)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock{ mtx_ };
+            while (tasks_.empty() && !stopped_ && !retire_)
+                cv_.wait(lock);
+            if (tasks_.empty() && (stopped_ || retire_))
+            {
+                if (!stopped_)
+                    --retire_;
+                --size_;
+                self.done = true;
+                return;
+            }
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+
+        ++active_;
+        auto start = Clock::now();
+        try
+        {
+            task();
+        }
+        catch (const std::exception& e)
+        {
+            std::cout << "pool task error: " << e.what() << "\n";
+        }
+        auto busy = (Clock::now() - start).count();
+
+        // may drop the last reference to the pool
+        task = nullptr;
+        if (currentPool != this)
+            return;
+        busy_ += busy;
+        --active_;
+    }
+}
+
+// samples queue depth, utilization (busy time of finished tasks, or running
+// workers, whichever is higher) and time spent blocked, grows when ready
+// tasks wait for busy or blocked workers, shrinks when idle
+void MqmThreadPool::monitor()
+{
+    const auto interval = std::chrono::duration_cast<Clock::duration>(limits_.interval).count();
+    size_t growStreak = 0;
+    size_t shrinkStreak = 0;
+
+    std::unique_lock<std::mutex> lock{ mtx_ };
+    while (!stopped_)
+    {
+        monitorCv_.wait_for(lock, limits_.interval);
+        if (stopped_)
+            break;
+
+        for (auto i = workers_.begin(); i != workers_.end(); )
+            if (i->done)
+            {
+                i->thread.join();
+                i = workers_.erase(i);
+            }
+            else
+                ++i;
+
+        size_t threads = size_;
+        size_t depth = tasks_.size();
+        size_t blocked = blocked_;
+        int64_t busy = std::max<int64_t>(busy_.exchange(0) - blockedTime_.exchange(0), 0);
+        double utilization = std::max(double(busy) / double(interval * threads),
+                                      double(active_ - std::min<size_t>(blocked, active_)) / threads);
+
+        bool grow = depth && (blocked || (depth >= threads && utilization >= limits_.highUtilization));
+        bool shrink = !depth && utilization <= limits_.lowUtilization;
+        growStreak = grow ? growStreak + 1 : 0;
+        shrinkStreak = shrink ? shrinkStreak + 1 : 0;
+
+        if (growStreak >= limits_.growAfter && threads < limits_.maxThreads)
+        {
+            spawn();
+            growStreak = 0;
+        }
+        else if (shrinkStreak >= limits_.shrinkAfter && threads - retire_ > limits_.minThreads)
+        {
+            ++retire_;
+            cv_.notify_one();
+            shrinkStreak = 0;
+        }
+    }
+}
+
+MqmThreadPool::Blocking::Blocking()
+    : pool_(currentPool)
+{
+    if (!pool_)
+        return;
+    start_ = Clock::now();
+    ++pool_->blocked_;
+}
+
+MqmThreadPool::Blocking::~Blocking()
+{
+    if (!pool_)
+        return;
+    pool_->blockedTime_ += (Clock::now() - start_).count();
+    --pool_->blocked_;
+}
+
+}
@@ -0,0 +1,136 @@
+#include "mqm/mqm_snapshot.h"
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+
+namespace mqm
+{
+
+namespace
+{
+namespace bip = boost::interprocess;
+
+using Length = uint32_t;
+
+const char Magic[8] = { 'M', 'Q', 'M', 'S', 'N', 'A', 'P', '1' };
+const size_t FlushSize = size_t(4) << 20;
+}
+
+MqmSnapshotWriter::MqmSnapshotWriter(const std::string& path)
+    : path_(path)
+    , temp_(path + ".tmp")
+    , out_(temp_, std::ios_base::out | std::ios_base::trunc | std::ios_base::binary)
+{
+    if (!out_)
+        throw std::runtime_error("Can't create snapshot file " + temp_);
+    buffer_.reserve(FlushSize + (FlushSize >> 2));
+    buffer_.append(Magic, sizeof(Magic));
+}
+
+MqmSnapshotWriter::~MqmSnapshotWriter()
+{
+    if (!out_.is_open())
+        return;
+    out_.close();
+    std::remove(temp_.c_str());
+}
+
+void MqmSnapshotWriter::flush()
+{
+    out_.write(buffer_.data(), buffer_.size());
+    if (!out_)
+        throw std::runtime_error("Can't write snapshot file " + temp_);
+    buffer_.clear();
+}
+
+std::string& MqmSnapshotWriter::begin()
+{
+    mark_ = buffer_.size();
+    buffer_.append(sizeof(Length), '\0');
+    return buffer_;
+}
+
+void MqmSnapshotWriter::end()
+{
+    const size_t size = buffer_.size() - mark_ - sizeof(Length);
+    if (size > std::numeric_limits<Length>::max())
+        throw std::runtime_error("Can't snapshot, value is too large");
+    Length length = static_cast<Length>(size);
+    std::memcpy(&buffer_[mark_], &length, sizeof(Length));
+    if (buffer_.size() >= FlushSize)
+        flush();
+}
+
+void MqmSnapshotWriter::record(const char* data, size_t size)
+{
+    begin().append(data, size);
+    end();
+}
+
+void MqmSnapshotWriter::count(uint64_t values)
+{
+    buffer_.append(reinterpret_cast<const char*>(&values), sizeof(values));
+}
+
+void MqmSnapshotWriter::close()
+{
+    flush();
+    out_.close();
+    // closed, the destructor won't remove it any more
+    if (!out_ || std::rename(temp_.c_str(), path_.c_str()) != 0)
+    {
+        std::remove(temp_.c_str());
+        throw std::runtime_error(out_ ? "Can't rename snapshot file to " + path_
+                                      : "Can't write snapshot file " + temp_);
+    }
+}
+
+MqmSnapshotReader::MqmSnapshotReader(const std::string& path)
+    : file_(new bip::file_mapping(path.c_str(), bip::read_only))
+    , region_(new bip::mapped_region(*file_, bip::read_only))
+{
+    pos_ = static_cast<const char*>(region_->get_address());
+    end_ = pos_ + region_->get_size();
+    if (end_ - pos_ < static_cast<std::ptrdiff_t>(sizeof(Magic)) || std::memcmp(pos_, Magic, sizeof(Magic)) != 0)
+        throw std::runtime_error("Can't restore, " + path + " is not a snapshot");
+    pos_ += sizeof(Magic);
+    region_->advise(bip::mapped_region::advice_sequential);
+}
+
+MqmSnapshotReader::~MqmSnapshotReader() = default;
+
+bool MqmSnapshotReader::record(const char*& data, size_t& size)
+{
+    if (pos_ == end_)
+        return false;
+    Length length = 0;
+    if (end_ - pos_ < static_cast<std::ptrdiff_t>(sizeof(Length)))
+        throw std::runtime_error("Can't restore, snapshot is truncated");
+    std::memcpy(&length, pos_, sizeof(Length));
+    pos_ += sizeof(Length);
+    if (static_cast<size_t>(end_ - pos_) < length)
+        throw std::runtime_error("Can't restore, snapshot is truncated");
+    data = pos_;
+    size = length;
+    pos_ += length;
+    return true;
+}
+
+uint64_t MqmSnapshotReader::count()
+{
+    uint64_t values = 0;
+    if (end_ - pos_ < static_cast<std::ptrdiff_t>(sizeof(values)))
+        throw std::runtime_error("Can't restore, snapshot is truncated");
+    std::memcpy(&values, pos_, sizeof(values));
+    pos_ += sizeof(values);
+    // every value takes at least its length
+    if (values > static_cast<size_t>(end_ - pos_) / sizeof(Length))
+        throw std::runtime_error("Can't restore, snapshot is truncated");
+    return values;
+}
+
+}
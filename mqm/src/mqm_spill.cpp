@@ -0,0 +1,168 @@
+#include "mqm/mqm_spill.h"
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+
+namespace mqm
+{
+
+namespace
+{
+namespace bip = boost::interprocess;
+
+using Length = uint32_t;
+
+std::atomic<uint64_t> spillFiles{ 0 };
+
+std::string spillPath(const std::string& directory)
+{
+    auto stamp = std::chrono::system_clock::now().time_since_epoch().count();
+    return directory + "/mqm_" + std::to_string(stamp) + "_" + std::to_string(spillFiles++) + ".spill";
+}
+}
+
+MqmSpill::MqmSpill(const std::string& directory, size_t segmentSize)
+    : directory_(directory.empty() ? "." : directory)
+    , segmentSize_(std::max<size_t>(segmentSize, 4096))
+{
+}
+
+MqmSpill::~MqmSpill()
+{
+    for (auto& s : segments_)
+        try
+        {
+            remove(s);
+        }
+        catch (const std::exception& e)
+        {
+            std::cout << "spill error: " << e.what() << "\n";
+        }
+}
+
+// a sparse file of 'size' bytes, mapped for writing
+void MqmSpill::create(size_t size)
+{
+    Segment s;
+    s.path = spillPath(directory_);
+    s.size = size;
+    {
+        std::filebuf file;
+        if (!file.open(s.path, std::ios_base::in | std::ios_base::out | std::ios_base::trunc | std::ios_base::binary))
+            throw std::runtime_error("Can't create spill file " + s.path);
+        file.pubseekoff(size - 1, std::ios_base::beg);
+        file.sputc(0);
+    }
+    map(s);
+    segments_.push_back(std::move(s));
+}
+
+void MqmSpill::map(Segment& s)
+{
+    if (s.region)
+        return;
+    bip::file_mapping file(s.path.c_str(), bip::read_write);
+    s.region.reset(new bip::mapped_region(file, bip::read_write, 0, s.size));
+}
+
+void MqmSpill::unmap(Segment& s)
+{
+    s.region.reset();
+}
+
+void MqmSpill::remove(Segment& s)
+{
+    unmap(s);
+    bip::file_mapping::remove(s.path.c_str());
+}
+
+void MqmSpill::append(const char* data, size_t size)
+{
+    const size_t record = sizeof(Length) + size;
+    if (size > std::numeric_limits<Length>::max())
+        throw std::runtime_error("Can't spill, value is too large");
+
+    if (!segments_.empty() && segments_.back().end + record > segments_.back().size)
+    {
+        auto& back = segments_.back();
+        if (back.pos == back.end && record <= back.size)
+            back.pos = back.end = 0;
+        else if (segments_.size() > 1)
+            unmap(back);
+    }
+    if (segments_.empty() || segments_.back().end + record > segments_.back().size)
+        create(std::max(segmentSize_, record));
+
+    auto& s = segments_.back();
+    map(s);
+    char* at = static_cast<char*>(s.region->get_address()) + s.end;
+    Length length = static_cast<Length>(size);
+    std::memcpy(at, &length, sizeof(Length));
+    std::memcpy(at + sizeof(Length), data, size);
+    s.end += record;
+    ++records_;
+}
+
+bool MqmSpill::front(const char*& data, size_t& size)
+{
+    if (!records_)
+        return false;
+    auto& s = segments_.front();
+    map(s);
+    const char* at = static_cast<const char*>(s.region->get_address()) + s.pos;
+    Length length = 0;
+    std::memcpy(&length, at, sizeof(Length));
+    data = at + sizeof(Length);
+    size = length;
+    return true;
+}
+
+void MqmSpill::pop()
+{
+    if (!records_)
+        return;
+    auto& s = segments_.front();
+    Length length = 0;
+    std::memcpy(&length, static_cast<const char*>(s.region->get_address()) + s.pos, sizeof(Length));
+    s.pos += sizeof(Length) + length;
+    --records_;
+    if (s.pos != s.end)
+        return;
+
+    // drained: a sealed segment goes, the one being written is rewound
+    if (segments_.size() > 1)
+    {
+        remove(s);
+        segments_.pop_front();
+    }
+    else
+        s.pos = s.end = 0;
+}
+
+void MqmSpill::read(const std::function<void(const char*, size_t)>& record)
+{
+    for (auto& s : segments_)
+    {
+        // sealed segments between the two ends are mapped only for the walk
+        bool mapped = s.region != nullptr;
+        map(s);
+        const char* base = static_cast<const char*>(s.region->get_address());
+        for (size_t pos = s.pos; pos < s.end;)
+        {
+            Length length = 0;
+            std::memcpy(&length, base + pos, sizeof(Length));
+            record(base + pos + sizeof(Length), length);
+            pos += sizeof(Length) + length;
+        }
+        if (!mapped)
+            unmap(s);
+    }
+}
+
+}
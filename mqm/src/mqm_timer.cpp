@@ -0,0 +1,78 @@
+#include "mqm/mqm_timer.h"
+#include <iostream>
+
+namespace mqm
+{
+
+MqmTimer::MqmTimer()
+    : thread_([this]() { run(); })
+{
+}
+
+// pending callbacks are dropped
+MqmTimer::~MqmTimer()
+{
+    {
+        std::unique_lock<std::mutex> lock{ mtx_ };
+        stopped_ = true;
+        cv_.notify_all();
+    }
+    thread_.join();
+}
+
+// rounded up, a callback never fires early
+uint64_t MqmTimer::tick(Clock::time_point when) const
+{
+    if (when <= start_)
+        return 0;
+    auto ticks = std::chrono::duration_cast<Tick>(when - start_);
+    return ticks.count() + (start_ + ticks < when ? 1 : 0);
+}
+
+void MqmTimer::schedule(Clock::duration delay, std::function<void()> task)
+{
+    at(Clock::now() + delay, std::move(task));
+}
+
+void MqmTimer::at(Clock::time_point when, std::function<void()> task)
+{
+    std::unique_lock<std::mutex> lock{ mtx_ };
+    uint64_t due = tick(when);
+    bool sooner = due < wheel_.next();
+    wheel_.add(due, std::move(task));
+    if (sooner)
+        cv_.notify_one();
+}
+
+void MqmTimer::run()
+{
+    std::vector<std::function<void()>> due;
+    std::unique_lock<std::mutex> lock{ mtx_ };
+    while (!stopped_)
+    {
+        uint64_t next = wheel_.next();
+        if (next == MqmTimingWheel<std::function<void()>>::Never)
+        {
+            cv_.wait(lock);
+            continue;
+        }
+        if (cv_.wait_until(lock, start_ + Tick(next)) != std::cv_status::timeout)
+            continue;
+
+        wheel_.advance(std::chrono::duration_cast<Tick>(Clock::now() - start_).count(), due);
+        lock.unlock();
+        for (auto& task : due)
+            try
+            {
+                task();
+            }
+            catch (const std::exception& e)
+            {
+                std::cout << "timer task error: " << e.what() << "\n";
+            }
+        due.clear();
+        lock.lock();
+    }
+}
+
+}
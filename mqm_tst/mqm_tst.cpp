@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cstdio>
 #include <iostream>
 #include <string>
 
@@ -15,11 +17,65 @@ public:
     }
 };
 
+// all keys of a group are consumed on one thread, no atomic needed
+class GroupConsumer : public mqm::MqmConsumer<size_t, std::string>
+{
+    size_t& total_;
+public:
+    GroupConsumer(size_t& total) : total_(total) {}
+    void consume(const size_t& id, const std::string& value)
+    {
+        ++total_;
+    }
+};
+
+// counts values that come in the order they were enqueued in
+class OrderConsumer : public mqm::MqmConsumer<size_t, uint64_t>
+{
+    std::atomic <size_t>& total_;
+    uint64_t next_ = 0;
+public:
+    OrderConsumer(std::atomic <size_t>& total) : total_(total) {}
+    void consume(const size_t& id, const uint64_t& value)
+    {
+        if (value == next_)
+            ++total_;
+        next_ = value + 2;
+    }
+};
+
+class SumConsumer : public mqm::MqmConsumer<size_t, uint64_t>
+{
+    std::atomic <uint64_t>& sum_;
+public:
+    SumConsumer(std::atomic <uint64_t>& sum) : sum_(sum) {}
+    void consume(const size_t& id, const uint64_t& value)
+    {
+        sum_ += value;
+    }
+};
+
+// one key, consumed on one thread; read once the processor is gone
+class CollectConsumer : public mqm::MqmConsumer<size_t, uint64_t>
+{
+    std::vector<uint64_t>& values_;
+    std::chrono::steady_clock::time_point& first_;
+public:
+    CollectConsumer(std::vector<uint64_t>& values, std::chrono::steady_clock::time_point& first)
+        : values_(values), first_(first) {}
+    void consume(const size_t& id, const uint64_t& value)
+    {
+        if (values_.empty())
+            first_ = std::chrono::steady_clock::now();
+        values_.push_back(value);
+    }
+};
+
 int main(int argc, char** argv)
 {
     const size_t totalIds = 100;
     const size_t totalMsg = 100500;
-    std::atomic <size_t> totalProcessed;
+    std::atomic <size_t> totalProcessed{ 0 };
     {
         mqm::MqmProcessor<size_t, std::string> processor;
         std::thread producer([&]() {
@@ -35,5 +91,297 @@ int main(int argc, char** argv)
     }
     std::cout << totalProcessed << " were processed\n";
 
+    // pooled drains: a key raised while its drain runs gets another run,
+    // no value is left behind
+    std::atomic <size_t> pooledProcessed{ 0 };
+    {
+        mqm::MqmProcessor<size_t, std::string> processor(std::make_shared<mqm::MqmThreadPool>(4));
+        std::thread producer([&]() {
+            for (size_t i = 0; i < totalMsg; ++i)
+                processor.enqueue(i % totalIds, "test_msg");
+        });
+
+        for (size_t i = 0; i < totalIds; ++i)
+            processor.subscribe(i, std::make_shared< TestConsumer >(pooledProcessed));
+
+        producer.join();
+    }
+    std::cout << pooledProcessed << " were processed on a pool\n";
+
+    // an elastic pool adds a worker per interval while ready tasks wait
+    // behind blocked ones, and retires the extra ones once idle
+    {
+        mqm::MqmPoolLimits limits;
+        limits.minThreads = 1;
+        limits.maxThreads = 4;
+        limits.interval = std::chrono::milliseconds(10);
+        limits.growAfter = 1;
+        limits.shrinkAfter = 5;
+        mqm::MqmThreadPool pool(limits);
+        auto waitFor = [](const std::function<bool()>& done) {
+            auto until = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+            while (!done() && std::chrono::steady_clock::now() < until)
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        };
+
+        std::atomic <size_t> started{ 0 };
+        std::atomic <bool> release{ false };
+        for (size_t i = 0; i < limits.maxThreads; ++i)
+            pool.post([&]() {
+                mqm::MqmThreadPool::Blocking blocking;
+                ++started;
+                while (!release)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            });
+        waitFor([&]() { return started == limits.maxThreads; });
+        size_t grown = pool.size();
+        release = true;
+        waitFor([&]() { return pool.size() == limits.minThreads; });
+        std::cout << "pool grew to " << grown << " threads under blocked workers and shrank back to "
+                  << pool.size() << "\n";
+    }
+
+    size_t groupProcessed = 0;
+    {
+        mqm::MqmProcessor<size_t, std::string> processor;
+        std::thread producer([&]() {
+            for (size_t i = 0; i < totalMsg; ++i)
+                processor.enqueue(i % totalIds, "test_msg");
+        });
+
+        std::vector<size_t> ids;
+        for (size_t i = 0; i < totalIds; ++i)
+            ids.push_back(i);
+        processor.subscribe(ids, std::make_shared< GroupConsumer >(groupProcessed));
+
+        producer.join();
+    }
+    std::cout << groupProcessed << " were processed by group\n";
+
+    // a key with more values pending than the ring holds turns into a work
+    // queue for competing consumers, the ring is sized up for the backlog
+    std::atomic <size_t> competeProcessed{ 0 };
+    {
+        mqm::MqmProcessor<size_t, std::string> processor;
+        const size_t backlog = mqm::MqmProcessor<size_t, std::string>::SharedCapacity + 4464;
+        for (size_t i = 0; i < backlog; ++i)
+            processor.enqueue(0, "test_msg");
+        for (size_t i = 0; i < 4; ++i)
+            processor.subscribe(0, std::make_shared< TestConsumer >(competeProcessed), mqm::MqmDelivery::Compete);
+        for (size_t i = backlog; i < totalMsg; ++i)
+            processor.enqueue(0, "test_msg");
+    }
+    std::cout << competeProcessed << " were processed by competing consumers\n";
+
+    // a snapshot that fails leaves the values queued (spilled ones too),
+    // the next one hands them to restore() in another processor
+    std::atomic <size_t> totalRestored{ 0 };
+    {
+        const std::string path = "mqm_tst.snap";
+        mqm::MqmProcessor<size_t, std::string> processor;
+        processor.spill(0, ".", 100);
+        for (size_t i = 0; i < totalMsg; ++i)
+            processor.enqueue(i % totalIds, "test_msg");
+        try
+        {
+            processor.snapshot(".");
+        }
+        catch (const std::exception& e)
+        {
+            std::cout << "snapshot failed: " << e.what() << "\n";
+        }
+        std::cout << processor.snapshot(path) << " were saved\n";
+
+        mqm::MqmProcessor<size_t, std::string> restored;
+        for (size_t i = 0; i < totalIds; ++i)
+            restored.subscribe(i, std::make_shared< TestConsumer >(totalRestored));
+        restored.restore(path);
+        std::remove(path.c_str());
+    }
+    std::cout << totalRestored << " were restored\n";
+
+    // trivially copyable values are restored as they were copied, key 0 in
+    // order, key 1 (odd values) to competing consumers
+    std::atomic <size_t> orderRestored{ 0 };
+    std::atomic <uint64_t> competeSum{ 0 };
+    {
+        const std::string path = "mqm_tst.snap";
+        mqm::MqmProcessor<size_t, uint64_t> processor;
+        for (uint64_t i = 0; i < totalMsg; ++i)
+            processor.enqueue(i % 2, uint64_t(i));
+        processor.snapshot(path);
+
+        mqm::MqmProcessor<size_t, uint64_t> restored;
+        restored.subscribe(0, std::make_shared< OrderConsumer >(orderRestored));
+        for (size_t i = 0; i < 2; ++i)
+            restored.subscribe(1, std::make_shared< SumConsumer >(competeSum), mqm::MqmDelivery::Compete);
+        restored.restore(path);
+        std::remove(path.c_str());
+    }
+    std::cout << orderRestored << " of " << (totalMsg + 1) / 2 << " were restored in order, "
+              << (competeSum == uint64_t(totalMsg / 2) * (totalMsg / 2) ? "all" : "not all")
+              << " odd ones by competing consumers\n";
+
+    // each policy holds the backlog of a key nobody consumes yet near
+    // its limit and counts what it drops; odd values rank higher
+    {
+        const uint64_t sent = 1000;
+        const mqm::MqmShedPolicy policies[] = {
+            mqm::MqmShedPolicy::DropNewest, mqm::MqmShedPolicy::DropOldest, mqm::MqmShedPolicy::DropPriority };
+        const char* names[] = { "drop newest", "drop oldest", "drop priority" };
+        for (size_t p = 0; p < 3; ++p)
+        {
+            std::vector<uint64_t> kept;
+            std::chrono::steady_clock::time_point first;
+            size_t dropped = 0;
+            {
+                mqm::MqmProcessor<size_t, uint64_t> processor;
+                mqm::MqmShedding<uint64_t> shedding;
+                shedding.policy = policies[p];
+                shedding.limit = 100;
+                shedding.priority = [](const uint64_t& v) { return int(v % 2); };
+                processor.shed(0, shedding);
+                for (uint64_t v = 0; v < sent; ++v)
+                    processor.enqueue(0, uint64_t(v));
+                dropped = processor.dropped(0);
+                processor.subscribe(0, std::make_shared< CollectConsumer >(kept, first));
+            }
+            size_t odd = std::count_if(kept.begin(), kept.end(), [](uint64_t v) { return v % 2; });
+            std::cout << names[p] << ": " << kept.size() << " kept (" << kept.front() << " to " << kept.back()
+                      << ", " << odd << " odd), " << dropped << " dropped of " << sent << "\n";
+        }
+    }
+
+    // CoDel drops incoming values once the oldest pending one has waited
+    // over the target for an interval
+    {
+        std::vector<uint64_t> kept;
+        std::chrono::steady_clock::time_point first;
+        size_t dropped = 0;
+        {
+            mqm::MqmProcessor<size_t, uint64_t> processor;
+            mqm::MqmShedding<uint64_t> shedding;
+            shedding.policy = mqm::MqmShedPolicy::CoDel;
+            shedding.limit = 1000;
+            shedding.target = std::chrono::microseconds(1000);
+            shedding.interval = std::chrono::microseconds(2000);
+            processor.shed(0, shedding);
+            for (uint64_t v = 0; v < 200; ++v)
+            {
+                processor.enqueue(0, uint64_t(v));
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+            dropped = processor.dropped(0);
+            processor.subscribe(0, std::make_shared< CollectConsumer >(kept, first));
+        }
+        std::cout << "codel: " << (dropped > 0 && kept.size() + dropped == 200 ? "drops" : "no drops")
+                  << " once the oldest value waits\n";
+    }
+
+    // a limit of 1 trims a busy queue back to one value, which still
+    // lingers from the arrival of the oldest one
+    {
+        std::vector<uint64_t> kept;
+        auto first = std::chrono::steady_clock::now();
+        const auto start = first;
+        {
+            mqm::MqmProcessor<size_t, uint64_t> processor;
+            mqm::MqmShedding<uint64_t> shedding;
+            shedding.policy = mqm::MqmShedPolicy::DropOldest;
+            shedding.limit = 1;
+            processor.shed(0, shedding);
+            processor.linger(0, 10, std::chrono::milliseconds(100));
+            processor.subscribe(0, std::make_shared< CollectConsumer >(kept, first));
+            for (uint64_t v = 0; v < 3; ++v)
+                processor.enqueue(0, uint64_t(v));
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        }
+        std::cout << "drop oldest to 1: " << kept.size() << " kept, "
+                  << (first - start >= std::chrono::milliseconds(90) ? "lingered" : "not lingered") << "\n";
+    }
+
+    // timers due on every level of the wheel fire on their tick once the
+    // levels above cascade down, one past its range waits in the overflow
+    {
+        mqm::MqmTimingWheel<uint64_t> wheel;
+        const uint64_t dues[] = { 3, 256, 70000, (uint64_t(1) << 24) + 7, (uint64_t(1) << 32) + 1 };
+        for (auto due : dues)
+            wheel.add(due, uint64_t(due));
+        size_t onTime = 0;
+        std::vector<uint64_t> due;
+        while (wheel.now() < (uint64_t(1) << 25))
+        {
+            wheel.advance(wheel.next(), due);
+            for (auto d : due)
+                onTime += d == wheel.now();
+            due.clear();
+        }
+        std::cout << onTime << " timers fired on time, " << wheel.size() << " still waits\n";
+    }
+
+    // spilled records span several segment files, read ones are deleted
+    // while others are written, a drained log rewinds its last segment
+    {
+        mqm::MqmSpill spill(".", 4096);
+        size_t written = 0;
+        size_t read = 0;
+        size_t inOrder = 0;
+        const char* data = nullptr;
+        size_t size = 0;
+        for (size_t round = 0; round < 5; ++round)
+        {
+            for (size_t i = 0; i < 1000; ++i)
+            {
+                auto record = std::to_string(written++) + "_spilled";
+                spill.append(record.data(), record.size());
+            }
+            for (size_t i = 0; round >= 3 || i < 600; ++i)
+            {
+                if (!spill.front(data, size))
+                    break;
+                inOrder += std::string(data, size) == std::to_string(read++) + "_spilled";
+                spill.pop();
+            }
+        }
+        std::cout << inOrder << " of " << written << " spilled records read back in order\n";
+    }
+
+    // an id is remembered for one to two windows: still the next window,
+    // gone the one after, earlier once full generations of new ids rotate,
+    // and two idle windows clear both (the bloom filter alone holds a few
+    // more for false positives)
+    for (bool exact : { true, false })
+    {
+        const auto window = std::chrono::seconds(1);
+        mqm::MqmDedup dedup(window, 2000, exact);
+        auto now = mqm::MqmDedup::Clock::now();
+        auto count = [&](uint64_t from, uint64_t to, bool seen) {
+            size_t n = 0;
+            for (uint64_t id = from; id < to; ++id)
+                n += dedup.contains(mqm::mqmDedupHash(id), now) == seen;
+            return n;
+        };
+        auto add = [&](uint64_t from, uint64_t to) {
+            size_t n = 0;
+            for (uint64_t id = from; id < to; ++id)
+                n += dedup.seen(mqm::mqmDedupHash(id), now);
+            return n;
+        };
+        add(0, 1000);
+        size_t caught = add(0, 1000);
+        now += window;
+        add(1000, 1500);
+        size_t kept = count(0, 1000, true);
+        now += window;
+        size_t forgotten = count(0, 1000, false);
+        add(1500, 5500);
+        size_t pushedOut = count(1000, 1500, false);
+        now += 2 * window;
+        size_t cleared = count(5000, 5500, false);
+        std::cout << (exact ? "exact" : "bloom") << " dedup: " << caught << " duplicates caught, "
+                  << kept << " kept and " << forgotten << " forgotten a window on, "
+                  << pushedOut << " pushed out, " << cleared << " cleared when idle\n";
+    }
+
     return 0;
 }